@@ -46,6 +46,8 @@
 	3.4) BIOS sends the IPMI request to get the memory fault info
 	3.5) BMC main() monitors a FIFO pipe (MFPFAULTQUEUE) &&
 	     BMC sends the collected info to the IPMI
+	3.6) A consumer that creates MFPFAULTACKQUEUE gets sequenced frames and
+	     acknowledges them there, which paces the next SCI
  	-	BMC SCI -> BIOS
 	-	BIOS -> IPMI(libipmiamioemmfpfault) -> BMC colMemFaultThread
 
@@ -90,6 +92,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdarg.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <time.h>
@@ -99,6 +102,12 @@
 #include <pthread.h>
 #include <sys/prctl.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <limits.h>
 #include "Types.h"
 #include "dbgout.h"
 #include "unix.h"
@@ -106,6 +115,7 @@
 #include "EINTR_wrappers.h"
 #include "mfp.h"
 #include "mfp_ami.h"
+#include "mfp_pageset.h"
 #include "hiredis.h"
 #include<sys/prctl.h>
 #if defined (CONFIG_SPX_FEATURE_MFP_2)
@@ -139,7 +149,6 @@
 
 /***********/
 #define	MAX_NEWERR		256
-#define SLEEP_THRESH	16
 #define ELAPSE_LIMIT	3
 #if !defined(DEBUG)
 #define SNAPSHOT_SAVE_INTERVAL  (24*60*60)
@@ -147,42 +156,350 @@
 #define SNAPSHOT_SAVE_INTERVAL  200
 #endif
 #define DATA_PROC_DEFER_TIME	180
-#define DATA_REC_SLEEP			5
 #define DATA_MEMORY_FAULT_TRANSFER_SLEEP  5
 #define DATA_MEMORY_FAULT_COLLECT_SLEEP   5
-#define CPU_DETECT_INTERVAL     300
 
-#define PIPE_READ_TIMEOUT		10
 #define PIPE_WRITE_TIMEOUT		10
+#define PIPE_RX_BUF_RECS		64
+#define MAIN_EPOLL_EVENTS		4
+#define VAL_KEY_POLL_MS			1000	/* MFP_VAL_KEY check without inotify */
 
 #define REDIS_SOCK		"/run/redis/redis.sock"
+#define REDIS_RECONNECT_MIN_MS	100
+#define REDIS_RECONNECT_MAX_MS	(30*1000)
 #define REDIS_LENGTH 100
 #define MEM_ENTRY_LEN	32
+#define HOST_BOOTING_KEY		"Redfish:HostBooting:Status"
+#define INVENTORY_STATUS_KEY	"Redfish:InventoryData:PostStatus:Status"
+#define HOST_READY_POLL_TIME	5
+#define HOST_READY_WARN_TIME	300
 
 /* Enumerate the column 128 times: 0 to (1024-8) */
 
-#define ADDR_TRANS_MASK_4K       ((unsigned long long) (~0x0FFF))
 #define ADDR_TRANS_COL_ADD_MIN   ((unsigned long long) (0x0000))
 #define ADDR_TRANS_COL_ADD_MAX   ((unsigned long long) (0x03FF))
 
 #define wakePECIAfterHostReset	1
 #define WaitSecondsPeriodBetweenErrorPooling	1
 
+/*
+ * PECI CE polling schedule. A channel that keeps reporting errors is
+ * revisited on every sweep; a quiet one doubles its interval from
+ * POLL_BASE_INTERVAL_MS up to POLL_MAX_INTERVAL_MS. errScore is a decaying
+ * error count (POLL_SCORE_UNIT per error, 1/2^POLL_SCORE_DECAY_SHIFT decay
+ * per poll); the channel stays hot while it is above POLL_HOT_SCORE.
+ */
+#define POLL_BASE_INTERVAL_MS	16
+#define POLL_MAX_INTERVAL_MS	(WaitSecondsPeriodBetweenErrorPooling*1000)
+#define POLL_SCORE_UNIT			256
+#define POLL_SCORE_DECAY_SHIFT	2
+#define POLL_HOT_SCORE			64
+
 #if 0
 static INT32	gSigUSR1=0;
 static struct timeval tReportStart, tReportEnd;
 #endif
 
+/* tlastErr, tCur and tlastSave are taken from CLOCK_MONOTONIC, see getMonoTime() */
 static struct timeval tlastErr, tCur, tlastSave;
 pthread_mutex_t	mfpDataMutex = PTHREAD_MUTEX_INITIALIZER;
-static INT32	newErrNum = 0;
-static INT32	newValErrNum = 0;
+/* signals computeMFPThread on new batch, full batch or mode change; uses CLOCK_MONOTONIC */
+pthread_cond_t	mfpDataCond;
+static INT32	mfpValMode = 0;
 static INT32	newShadowErrNum = 0;
-struct mfp_error	newErr[MAX_NEWERR];
-mfpval_error	newValErr[MAX_NEWERR];
+
+/*
+ * New errors are double buffered. Producers append to the fill batch under
+ * mfpDataMutex; computeMFPThread() only holds the mutex to swap the fill
+ * batch with the idle one and evaluates the detached batch unlocked.
+ *
+ * Repeats of an error already in the fill batch are coalesced into its
+ * record: count[] holds the occurrences, first[]/last[] their wall time.
+ * hash[] indexes err[] by location (index + 1, 0 = empty) and is cleared
+ * whenever the batch is swapped in, so the coalescing window is the life
+ * of one batch.
+ */
+#define COALESCE_HASH_SIZE		(MAX_NEWERR*2)	/* power of two */
+
+struct mfp_err_batch {
+	INT32				num;
+	struct mfp_error	err[MAX_NEWERR];
+	INT32U				count[MAX_NEWERR];
+	time_t				first[MAX_NEWERR];
+	time_t				last[MAX_NEWERR];
+	INT16U				hash[COALESCE_HASH_SIZE];
+};
+
+struct mfp_valerr_batch {
+	INT32			num;
+	mfpval_error	err[MAX_NEWERR];
+};
+
+static struct mfp_err_batch		errBatch[2];
+static struct mfp_err_batch		*fillErrBatch = &errBatch[0];
+static struct mfp_valerr_batch	valErrBatch[2];
+static struct mfp_valerr_batch	*fillValErrBatch = &valErrBatch[0];
+
+/*
+ * Overflow tier behind a full fill batch. Records wait in a growable
+ * memory FIFO of up to OVERFLOW_MEM_MAX_RECS, then in an append-only
+ * spill file on tmpfs. While anything is queued here new records are
+ * queued behind it and the fill batch is refilled from the head, so the
+ * engine sees errors in arrival order. Records are only dropped when
+ * the spill file is full. Everything is under mfpDataMutex.
+ */
+#define OVERFLOW_MEM_INIT_RECS	MAX_NEWERR
+#define OVERFLOW_MEM_MAX_RECS	(MAX_NEWERR*16)
+#define OVERFLOW_SPILL_MAX_RECS	(MAX_NEWERR*1024)
+#define MFP_ERR_SPILL			"/var/run/mfp_err.spill"
+#define MFP_VALERR_SPILL		"/var/run/mfp_valerr.spill"
+
+struct mfp_overflow_stat {
+	unsigned long long	overflowed;	/* records queued behind a full batch */
+	unsigned long long	spilled;	/* part of them that went to the spill file */
+	unsigned long long	dropped;	/* records lost, spill file full or failing */
+	INT32U				pending;	/* records queued now */
+};
+
+struct mfp_overflow {
+	const char	*spillPath;
+	size_t		recSize;
+	char		*mem;
+	INT32U		memHead;		/* in records */
+	INT32U		memCount;
+	INT32U		memCap;
+	int			spillFd;
+	INT32U		spillHead;		/* records already read back */
+	INT32U		spillCount;		/* records behind spillHead */
+	struct mfp_overflow_stat stat;
+};
+
+static struct mfp_overflow errOverflow = { MFP_ERR_SPILL, sizeof(struct mfp_error), NULL, 0, 0, 0, -1, 0, 0, {0, 0, 0, 0} };
+static struct mfp_overflow valErrOverflow = { MFP_VALERR_SPILL, sizeof(mfpval_error), NULL, 0, 0, 0, -1, 0, 0, {0, 0, 0, 0} };
+
+/* errors pushed by producers vs records handed to the engine, under mfpDataMutex */
+static struct mfp_coalesce_stat {
+	unsigned long long	occurrences;
+	unsigned long long	records;
+} coalesceStat;
+
+/*
+ * Receive buffer of a record FIFO (MFPQUEUE or MFPVALQUEUE). Each wakeup
+ * drains everything the pipe holds; a trailing partial record stays in
+ * buf and is completed by the next read.
+ */
+union mfp_pipe_rec {
+	struct mfp_error	err;
+	mfpval_error		valerr;
+};
+
+struct mfp_pipe_rx {
+	int		fd;
+	int		tag;		/* epoll tag of the FIFO */
+	size_t	recSize;
+	size_t	len;
+	union mfp_pipe_rec	buf[PIPE_RX_BUF_RECS];
+};
+/* most struct mfp_error records a full MFPQUEUE receive buffer can hold */
+#define PIPE_RX_MAX_ERRS		(sizeof(union mfp_pipe_rec) * PIPE_RX_BUF_RECS / sizeof(struct mfp_error))
+
+/* epoll tags of the main() event loop */
+enum {
+	MAIN_EV_FIFO = 0,
+	MAIN_EV_VALFIFO,
+	MAIN_EV_VALKEY,
+};
+
+/*
+ * Local IPMI session shared by every SEL writer, opened on first use and
+ * reopened after a failure. selStat tells the insert latency apart from
+ * the session setup cost that used to be paid for every entry.
+ */
+static pthread_mutex_t	selSessionMutex = PTHREAD_MUTEX_INITIALIZER;
+static IPMI20_SESSION_T	selSession;
+static int	selSessionOpen = 0;
+static struct mfp_sel_stat {
+	INT32U				count;
+	unsigned long long	totalUs;
+	unsigned long long	maxUs;
+	INT32U				opens;
+	unsigned long long	openUs;
+} selStat;
+
+/*
+ * SEL writer queue. Producers only queue the errors to log and go back to
+ * collecting; selWriterThread() writes up to SEL_WRITE_BATCH of them per
+ * session lock. MFP_SEL_QUEUE_POLICY picks what a full queue does: drop
+ * the new entries, drop the oldest queued ones or block the producer.
+ */
+#define SEL_QUEUE_LEN			512
+#define SEL_WRITE_BATCH			32
+#define SEL_QUEUE_DROP_NEWEST	0
+#define SEL_QUEUE_DROP_OLDEST	1
+#define SEL_QUEUE_BLOCK			2
+#ifndef MFP_SEL_QUEUE_POLICY
+#define MFP_SEL_QUEUE_POLICY	SEL_QUEUE_DROP_NEWEST
+#endif
+
+/*
+ * SEL aggregation. Once a DIMM has produced more than SEL_AGG_THRESHOLD
+ * errors (repeats included) within the current SEL_AGG_WINDOW, its errors
+ * stop producing individual records and are counted instead. At the end
+ * of every window the writer logs one summary record per such DIMM and
+ * the DIMM leaves aggregation mode after a window below the threshold.
+ * SEL_AGG_THRESHOLD 0 disables aggregation.
+ *
+ *	OEM Rec Type MEMORYFAILURE_SUMMARY_OEMRECTYPE
+ *	OEMData[0] : SOCKET, Bit7-5; IMC, Bit4-3; CHANNEL, Bit2-1, as OEM Rec Type 0xC4
+ *	OEMData[1] : SLOT, Bit7-6
+ *	OEMData[2-3] : number of errors not logged individually, LSB first, saturated
+ *	OEMData[4-5] : seconds between the first and last of them, LSB first, saturated
+ */
+#ifndef MEMORYFAILURE_SUMMARY_OEMRECTYPE
+#define MEMORYFAILURE_SUMMARY_OEMRECTYPE	0xC5
+#endif
+#ifndef SEL_AGG_THRESHOLD
+#define SEL_AGG_THRESHOLD		16
+#endif
+#ifndef SEL_AGG_WINDOW
+#define SEL_AGG_WINDOW			60
+#endif
+
+struct mfp_sel_agg {
+	INT8U	socket;
+	INT8U	imc;
+	INT8U	channel;
+	INT8U	dimm;
+	INT8U	aggregating;
+	INT32U	count;			/* errors in the current window */
+	INT32U	suppressed;		/* errors counted instead of logged */
+	time_t	first;
+	time_t	last;
+};
+
+static pthread_mutex_t	selQueueMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	selQueueCond;		/* entries queued; uses CLOCK_MONOTONIC */
+static pthread_cond_t	selQueueSpaceCond = PTHREAD_COND_INITIALIZER;	/* entries taken */
+static struct mfp_error	selQueue[SEL_QUEUE_LEN];
+static int	selQueueHead = 0;
+static int	selQueueCount = 0;
+static unsigned long long	selQueueDropped = 0;
+static struct mfp_sel_agg	selAgg[MAX_DIMM_COUNT];
+static int	selAggCount = 0;
+static time_t	selAggWindowStart = 0;
+
+/*
+ * Daemon startup as a dependency graph. main() loads the Redfish inventory
+ * while startupPeciThread() discovers the CPUs over PECI and initializes
+ * address decode. The memory configuration needs the inventory and the
+ * CPUs, the engine needs the memory configuration and the fault replay
+ * needs the engine, address decode and a host that completed POST. Each
+ * stage logs when it finished relative to daemon start.
+ */
+enum {
+	STAGE_INVENTORY = 0,
+	STAGE_PECI,
+	STAGE_ADDR_DECODE,
+	STAGE_MEM_CONFIG,
+	STAGE_ENGINE,
+	STAGE_HOST_READY,
+	STAGE_FAULT_REPLAY,
+	STAGE_COUNT,
+};
+#define STAGE_BIT(stage)		(1U << (stage))
+#define STAGE_PENDING			0
+#define STAGE_RUNNING			1
+#define STAGE_DONE				2
+#define STAGE_FAILED			3
+#define PECI_DISCOVERY_RETRY	5
+
+struct mfp_startup_stage {
+	const char			*name;
+	int					state;
+	unsigned long long	startMs;
+	unsigned long long	doneMs;
+};
+
+static struct mfp_startup_stage startupStage[STAGE_COUNT] = {
+	{ "inventory", STAGE_PENDING, 0, 0 },
+	{ "PECI discovery", STAGE_PENDING, 0, 0 },
+	{ "address decode", STAGE_PENDING, 0, 0 },
+	{ "memory config", STAGE_PENDING, 0, 0 },
+	{ "MFP engine", STAGE_PENDING, 0, 0 },
+	{ "host ready", STAGE_PENDING, 0, 0 },
+	{ "fault replay", STAGE_PENDING, 0, 0 },
+};
+static pthread_mutex_t	startupMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	startupCond = PTHREAD_COND_INITIALIZER;
+static unsigned long long	startupMs = 0;
+
+/* time producers spent waiting for mfpDataMutex, reset on every evaluation */
+struct mfp_lock_wait {
+	INT32U				count;
+	unsigned long long	totalUs;
+	unsigned long long	maxUs;
+};
+static struct mfp_lock_wait producerLockWait;
 
 static int fdFaultFifo = 0;
 
+/*
+ * Offlined pages are queued by queueOffLinePages() and handed to BIOS by
+ * deliverOffLinePages(), row and cell pages together. A consumer that
+ * creates MFPFAULTACKQUEUE is sent frames (struct mfp_fault_frame and up to
+ * MAX_FAULT_ERR addresses, each no larger than PIPE_BUF so it is written
+ * atomically) in windows of at most FAULT_FRAME_WINDOW frames, one SCI per
+ * window, and writes back the sequence number of every frame it has passed
+ * on. A window never exceeds the FIFO capacity, since the consumer only
+ * drains after the SCI. The next window is sent on the acknowledgement of
+ * the last frame, waiting no longer than four times the average
+ * acknowledgement latency within FAULT_ACK_MIN_MS..FAULT_ACK_MAX_MS. When a
+ * window is not acknowledged, the pages not yet written stay queued and
+ * nothing more is written until the consumer catches up. Without an ack FIFO the
+ * legacy count + addresses format is sent, row and cell pages in separate
+ * chunks as the legacy consumer expects, with one SCI per chunk. The next
+ * chunk follows as soon as the consumer has read the FIFO empty, polled
+ * every FAULT_DRAIN_POLL_MS, and no later than FAULT_LEGACY_SCI_WAIT.
+ */
+#define MFPFAULTACKQUEUE		MFPFAULTQUEUE ".ack"
+#define FAULT_FRAME_MAGIC		0x46504D46U		/* "FMPF" */
+#define FAULT_FRAME_WINDOW		32
+#define FAULT_ACK_MIN_MS		50
+#define FAULT_ACK_MAX_MS		2000
+#define FAULT_LEGACY_SCI_WAIT	2
+#define FAULT_DRAIN_POLL_MS		20
+#define FAULT_DELIVERY_RANGES	2
+
+struct mfp_fault_frame {
+	INT32U	magic;
+	INT32U	seq;
+	INT32	count;
+	INT32U	reserved;
+};
+
+#define FAULT_FRAME_MAX_BYTES	(sizeof(struct mfp_fault_frame) + MAX_FAULT_ERR * sizeof(unsigned long long))
+_Static_assert(sizeof(struct mfp_fault_frame) + MAX_FAULT_ERR * sizeof(unsigned long long) <= PIPE_BUF,
+		"a fault frame must fit in PIPE_BUF to be written atomically");
+
+struct mfp_fault_range {
+	unsigned long long	*pSysAddr;
+	int					*start;
+	int					end;
+};
+
+static struct mfp_fault_range faultDelivery[FAULT_DELIVERY_RANGES];
+static int		faultDeliveryNum = 0;
+static int		fdFaultAck = -1;
+static INT32U	faultSeq = 0;
+static INT32U	faultAckedSeq = 0;
+static unsigned long long	faultAckAvgMs = FAULT_ACK_MAX_MS / 4;
+static struct {
+	unsigned long		frames;
+	unsigned long		scis;
+	unsigned long		timeouts;
+	unsigned long long	maxAckMs;
+} faultStat;
+
 typedef void (*pPDKFunc) (void );
 void *dl_pdkhandle = NULL;
 static int pdkSCIFuncsInited = 0;
@@ -196,14 +513,95 @@ static struct mfp_dimm_entry dimmArray[MAX_DIMM_COUNT];
 
 static struct mfp_dimm_entry dimmArrayVal[MAX_DIMM_COUNT];
 
+struct mfp_poll_chan;
+
+/*
+ * Register backend of the PECI CE collector: per channel retry-log
+ * initialization, error lookup and the topology of channels it polls.
+ * DDR and HBM channels are swept by the same socket workers.
+ */
+struct mfp_collect_backend {
+	const char	*name;
+	/* IMC x channel range of a socket probed by initChannel, 0 x 0 if it has none */
+	void	(*probeRange)(INT8U cpu, INT8U *imcCount, INT8U *chanCount);
+	int		(*initChannel)(INT8U cpu, INT8U imc, INT8U chan);
+	void	(*lookForErrors)(struct mfp_poll_chan *chan, MemErrorStruct *memErr, bool *validError);
+	int		(*buildTopology)(const struct mfp_collect_backend *backend, struct mfp_poll_chan *chans, int maxChans);
+};
+
+/* one PECI polled channel; two DIMMs of a channel share its retry-log registers */
+struct mfp_poll_chan {
+	const struct mfp_collect_backend	*backend;
+	INT8U	socket;
+	INT8U	imc;
+	INT8U	channel;
+	INT32U	intervalMs;
+	INT32U	errScore;
+	unsigned long long	nextPollMs;
+};
+
+#define MAX_POLL_CHAN_COUNT		(MAX_DIMM_COUNT*2)
+static struct mfp_poll_chan pollChan[MAX_POLL_CHAN_COUNT];
+static int	pollChanCount = 0;
+
+#if defined CONFIG_SPX_FEATURE_MFP_3_1 && defined (MRT_CPU_HBM)
+/*
+ * HBM channel range of the CPU type that carries HBM, probed at startup
+ * only on sockets DetectCpuType() reports as that type. Platform headers
+ * may override all three.
+ */
+#ifndef HBM_CPU_TYPE
+#define HBM_CPU_TYPE			CPU_SPR
+#endif
+#ifndef HBM_NUMBER_OF_IMCS
+#define HBM_NUMBER_OF_IMCS		NUMBER_OF_IMCS
+#endif
+#ifndef HBM_NUMBER_OF_CHANNELS
+#define HBM_NUMBER_OF_CHANNELS	NUMBER_OF_CHANNELS
+#endif
+#define MAX_HBM_CHAN_COUNT		(MAX_AMOUNT_OF_CPUS*HBM_NUMBER_OF_IMCS*HBM_NUMBER_OF_CHANNELS)
+
+/*
+ * HBM channels that answered the retry-log initialization over PECI.
+ * This is independent of the DDR DIMM inventory; the position in
+ * hbmTopology is the dense HBM channel index.
+ */
+struct mfp_hbm_chan {
+	INT8U	socket;
+	INT8U	imc;
+	INT8U	channel;
+};
+static struct mfp_hbm_chan hbmTopology[MAX_HBM_CHAN_COUNT];
+static int	hbmChanCount = 0;
+#endif
+
+/*
+ * PECI CE collector of one socket, see mfp2SocketThread(). peciMutex
+ * covers every PECI library call addressed to the socket, so calls for
+ * one CPU never overlap while different sockets keep their transactions
+ * in flight at the same time.
+ */
+struct mfp_socket_worker {
+	INT8U	socket;
+	struct mfp_poll_chan	*chans;
+	int		chanCount;
+	pthread_t	tid;
+	pthread_mutex_t	peciMutex;
+};
+static struct mfp_socket_worker socketWorker[MAX_AMOUNT_OF_CPUS];
+
 struct mfp_evaluate_result *results = NULL;
 static UINT16	dimmID[MAX_DIMM_COUNT];
 static char		memEntry[MAX_DIMM_COUNT][MEM_ENTRY_LEN] =  {{0}};
 static FILE 	*fp = NULL;
 static FILE		*fpSave	= NULL;
-static FILE		*fpStat = NULL;
 static char env_systems_name[REDIS_LENGTH] = {0};
 static INT32	redfishReportInit = 0;
+/* last dimm_score published per memEntry slot */
+#define REDFISH_SCORE_UNKNOWN	(-1)
+static INT32	redfishScore[MAX_DIMM_COUNT];
+/* memEntry slot of every pipelined dimm_score SET, -1 for other commands */
+static INT32	redfishCmdSlot[MAX_DIMM_COUNT*3];
 
 static INT8U	nrCPU = 0;
 static CpuTypes type[MAX_AMOUNT_OF_CPUS];
@@ -216,102 +614,571 @@ static int DDR5ColWidth = 0;
 
 unsigned long long *rowOffLinedPagesSysAddr = NULL;
 unsigned long long *cellOffLinedPagesSysAddr = NULL;
+
+/* 4KB pages already offlined, kept next to the offlined page arrays the FIFO writes are fed from */
+static struct mfp_page_set rowPageSet;
+static struct mfp_page_set cellPageSet;
 FILE *pRowFaultRec = NULL;
 FILE *pCellFaultRec = NULL;
 
-#if defined (TRACK_DETECTED_CORR_ERROR) && defined (MRT_DEBUG_TIME_STAMP)
-struct timeval mrt_t0, mrt_t1;
-#endif
+/*
+ * MFP_REPORT keeps its format, one ami_mfp_evaluate_result per DIMM.
+ * MFP_REPORT_V1 carries the same records behind a report header. The
+ * report is built in memory and both files are published only when it
+ * differs from the last published one, each by writing a temporary file
+ * and renaming it over the report, so a reader always sees a complete
+ * report. The generation grows with every publish and continues from the
+ * one in MFP_REPORT_V1 across restarts; the checksum covers the records.
+ */
+#define MFP_REPORT_MAGIC		0x5250464DU		/* "MFPR" */
+#define MFP_REPORT_VERSION		1
+#define MFP_REPORT_TMP			MFP_REPORT ".tmp"
+#define MFP_REPORT_V1			MFP_REPORT "_v1"
+#define MFP_REPORT_V1_TMP		MFP_REPORT_V1 ".tmp"
+
+struct mfp_report_header {
+	INT32U	magic;
+	INT16U	version;
+	INT16U	count;
+	INT32U	generation;
+	INT32U	checksum;
+};
+
+static struct {
+	struct mfp_report_header	hdr;
+	ami_mfp_evaluate_result		rec[MAX_DIMM_COUNT];
+} mfpReport;
+static UINT32	mfpReportCount = 0;
+static int		mfpReportPublished = 0;
+static int		mfpReportSeeded = 0;
+static unsigned long	mfpReportSkipped = 0;
+
+/* FNV-1a over the report records */
+static INT32U reportChecksum(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	INT32U hash = 2166136261U;
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		hash ^= p[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/* continue the generation of the MFP_REPORT_V1 a previous run left */
+static void seedReportGeneration(void)
+{
+	struct mfp_report_header hdr;
+	FILE *fpRep;
+
+	mfpReportSeeded = 1;
+	fpRep = fopen(MFP_REPORT_V1, "rb");
+	if (fpRep == NULL) {
+		return;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, fpRep) == 1 && hdr.magic == MFP_REPORT_MAGIC && hdr.version == MFP_REPORT_VERSION) {
+		mfpReport.hdr.generation = hdr.generation;
+		TINFO("%s generation %u found\n", MFP_REPORT_V1, hdr.generation);
+	}
+	fclose(fpRep);
+}
+
+/* write buf to tmpPath and rename it over path */
+static int publishReportFile(const char *path, const char *tmpPath, const void *buf, size_t len)
+{
+	int fd;
+
+	fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		TCRIT("Unable to open %s file\n", tmpPath);
+		return -1;
+	}
+	if (write(fd, buf, len) != (ssize_t)len || fsync(fd) != 0) {
+		TCRIT("writing %s error\n", tmpPath);
+		close(fd);
+		unlink(tmpPath);
+		return -1;
+	}
+	close(fd);
+	if (rename(tmpPath, path) != 0) {
+		TCRIT("Unable to rename %s to %s\n", tmpPath, path);
+		unlink(tmpPath);
+		return -1;
+	}
+	return 0;
+}
 
 int genMFPReport(UINT16 *pDimmID, struct mfp_evaluate_result *pResult, UINT32 count)
 {
-	size_t i;
+	size_t i, len;
 	ami_mfp_evaluate_result mfpResult;
-	FILE *fpRep;
+	int changed;
 
-	/* No need to call fclose() in case of failure */
 	if ( count == 0 || pResult == NULL) {
 		TWARN("no dimm is found or pResult is NULL\n");
 		return 0;
 	}
-
-	fpRep = fopen(MFP_REPORT,"wb");
-	if(fpRep == NULL) {
-		TCRIT("Unable to open %s file\n", MFP_REPORT);
-		return -1;
+	if (count > MAX_DIMM_COUNT) {
+		count = MAX_DIMM_COUNT;
 	}
-	
+
+	/* compare with the last published report while building the new one */
+	changed = !mfpReportPublished || count != mfpReportCount;
 	for (i=0; i<count; i++)  {
+		memset(&mfpResult, 0, sizeof(mfpResult));
 		mfpResult.dimmID = pDimmID[i];
 		memcpy(&mfpResult.result, &pResult[i], sizeof(struct mfp_evaluate_result));
-		if ( 1 != fwrite(&mfpResult, sizeof(ami_mfp_evaluate_result), 1, fpRep)) {
-			TCRIT("writing MFP Report error\n");
-			fclose(fpRep);
-			return -1;
+		if (changed || memcmp(&mfpReport.rec[i], &mfpResult, sizeof(mfpResult)) != 0) {
+			memcpy(&mfpReport.rec[i], &mfpResult, sizeof(mfpResult));
+			changed = 1;
 		}
 	}
-	fclose(fpRep);
+	if (!changed) {
+		mfpReportSkipped++;
+		return 0;
+	}
+	mfpReportCount = count;
+	if (!mfpReportSeeded) {
+		seedReportGeneration();
+	}
+
+	len = count * sizeof(ami_mfp_evaluate_result);
+	mfpReport.hdr.magic = MFP_REPORT_MAGIC;
+	mfpReport.hdr.version = MFP_REPORT_VERSION;
+	mfpReport.hdr.count = (INT16U)count;
+	mfpReport.hdr.generation++;
+	mfpReport.hdr.checksum = reportChecksum(mfpReport.rec, len);
+
+	if (publishReportFile(MFP_REPORT, MFP_REPORT_TMP, mfpReport.rec, len) != 0
+			|| publishReportFile(MFP_REPORT_V1, MFP_REPORT_V1_TMP, &mfpReport, len + sizeof(struct mfp_report_header)) != 0) {
+		mfpReportPublished = 0;
+		return -1;
+	}
+	mfpReportPublished = 1;
+	TINFO("MFP Report generation %u published, %lu unchanged reports skipped\n",
+			mfpReport.hdr.generation, mfpReportSkipped);
+
+	return 0;
+}
+
+/*
+ * Redis connection shared by the whole daemon. A caller brackets its
+ * commands with redisMgrAcquire()/redisMgrRelease(), which serialize the
+ * users. The connection is opened on demand, dropped on any I/O error and
+ * reopened no sooner than the current backoff, which doubles from
+ * REDIS_RECONNECT_MIN_MS to REDIS_RECONNECT_MAX_MS on each failure.
+ * Replies stay owned by the manager: the one handed out last is freed by
+ * the next redisMgrCommand()/redisMgrGetReply() or by redisMgrRelease(),
+ * which also discards pipelined replies the caller did not read.
+ */
+static struct mfp_redis_mgr {
+	pthread_mutex_t		lock;
+	redisContext		*ctx;
+	redisReply			*reply;		/* last reply handed out */
+	int					pending;	/* appended commands not read yet */
+	INT32U				backoffMs;
+	unsigned long long	nextConnectMs;
+} redisMgr = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0, REDIS_RECONNECT_MIN_MS, 0 };
+
+static void getMonoTime(struct timeval *tv)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	tv->tv_sec = ts.tv_sec;
+	tv->tv_usec = ts.tv_nsec / 1000;
+}
+
+static unsigned long long getMonoMs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* ***************************************************************
+ * Startup stages: record and signal the progress of a stage
+ *****************************************************************/
+static void beginStage(int stage)
+{
+	pthread_mutex_lock(&startupMutex);
+	startupStage[stage].state = STAGE_RUNNING;
+	startupStage[stage].startMs = getMonoMs();
+	pthread_mutex_unlock(&startupMutex);
+}
+
+/* a stage finishes once; later calls are ignored */
+static void endStage(int stage, int ok)
+{
+	struct mfp_startup_stage *st = &startupStage[stage];
+
+	pthread_mutex_lock(&startupMutex);
+	if (st->state != STAGE_DONE && st->state != STAGE_FAILED) {
+		if (st->state == STAGE_PENDING) {
+			st->startMs = getMonoMs();
+		}
+		st->doneMs = getMonoMs();
+		st->state = ok ? STAGE_DONE : STAGE_FAILED;
+		TINFO("startup stage %s %s at +%llu ms, took %llu ms\n", st->name, ok ? "done" : "failed",
+				st->doneMs - startupMs, st->doneMs - st->startMs);
+		pthread_cond_broadcast(&startupCond);
+	}
+	pthread_mutex_unlock(&startupMutex);
+}
+
+static int isStageFinished(int stage)
+{
+	int state;
+
+	pthread_mutex_lock(&startupMutex);
+	state = startupStage[stage].state;
+	pthread_mutex_unlock(&startupMutex);
+	return (state == STAGE_DONE || state == STAGE_FAILED);
+}
+
+/* block until every stage in mask is done; return -1 as soon as one of them failed */
+static int waitStages(INT32U mask)
+{
+	int stage, ret;
 
+	pthread_mutex_lock(&startupMutex);
+	while (1) {
+		ret = 0;
+		for (stage=0; stage<STAGE_COUNT; stage++) {
+			if (!(mask & STAGE_BIT(stage))) {
+				continue;
+			}
+			if (startupStage[stage].state == STAGE_FAILED) {
+				ret = -1;
+				break;
+			}
+			if (startupStage[stage].state != STAGE_DONE) {
+				ret = 1;
+			}
+		}
+		if (ret <= 0) {
+			break;
+		}
+		pthread_cond_wait(&startupCond, &startupMutex);
+	}
+	pthread_mutex_unlock(&startupMutex);
+	return ret;
+}
+
+/*
+ * MFP_STAT_RESULT holds MAX_DIMM_COUNT struct mfp_stat_result indexed by
+ * getIndexOfDimm(). It is mapped once at startup and updated in place;
+ * other processes reading the file see the updates through the page cache
+ * right away, and flushStatResult() pushes dirty pages to storage no more
+ * often than every STAT_FLUSH_INTERVAL_MS unless forced.
+ */
+#define STAT_FLUSH_INTERVAL_MS		30000
+#define STAT_MAP_SIZE				(MAX_DIMM_COUNT * sizeof(struct mfp_stat_result))
+
+static pthread_mutex_t	statMapMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct mfp_stat_result	*statMap = NULL;
+static int		statMapDirty = 0;
+static unsigned long long	statMapFlushMs = 0;
+static struct {
+	unsigned long	updates;
+	unsigned long	unchanged;
+	unsigned long	flushes;
+} statMapStat;
+
+static int mapStatResult(void)
+{
+	struct stat st;
+	void *addr;
+	int fd;
+
+	fd = open(MFP_STAT_RESULT, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		TCRIT("Unable to create %s file\n", MFP_STAT_RESULT);
+		return -1;
+	}
+	/* a new or short file is zero extended, which reads as no errors */
+	if (fstat(fd, &st) != 0 || ((size_t)st.st_size < STAT_MAP_SIZE && ftruncate(fd, STAT_MAP_SIZE) != 0)) {
+		TCRIT("Unable to size %s file\n", MFP_STAT_RESULT);
+		close(fd);
+		return -1;
+	}
+	addr = mmap(NULL, STAT_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		TCRIT("Unable to map %s file\n", MFP_STAT_RESULT);
+		return -1;
+	}
+	statMap = addr;
+	statMapFlushMs = getMonoMs();
+	TINFO("stat result map size is  %u \n", (unsigned)STAT_MAP_SIZE);
+	return 0;
+}
+
+static void flushStatResult(int force)
+{
+	unsigned long long now;
+
+	pthread_mutex_lock(&statMapMutex);
+	now = getMonoMs();
+	if (statMap != NULL && statMapDirty && (force || now - statMapFlushMs >= STAT_FLUSH_INTERVAL_MS)) {
+		if (msync(statMap, STAT_MAP_SIZE, MS_SYNC) != 0) {
+			TCRIT("msync %s error\n", MFP_STAT_RESULT);
+		}
+		statMapDirty = 0;
+		statMapFlushMs = now;
+		statMapStat.flushes++;
+		TDBG("stat result flushed: %lu updates, %lu unchanged, %lu flushes\n",
+				statMapStat.updates, statMapStat.unchanged, statMapStat.flushes);
+	}
+	pthread_mutex_unlock(&statMapMutex);
+}
+
+static void unmapStatResult(void)
+{
+	flushStatResult(1);
+	pthread_mutex_lock(&statMapMutex);
+	if (statMap != NULL) {
+		munmap(statMap, STAT_MAP_SIZE);
+		statMap = NULL;
+	}
+	pthread_mutex_unlock(&statMapMutex);
+}
+
+/* redisMgr.lock must be held; forget a broken connection and its pending replies */
+static void redisMgrDrop(void)
+{
+	if (redisMgr.ctx != NULL) {
+		TWARN("redis connection lost: %s\n", redisMgr.ctx->errstr);
+		redisFree(redisMgr.ctx);
+		redisMgr.ctx = NULL;
+	}
+	redisMgr.pending = 0;
+	redisMgr.nextConnectMs = getMonoMs() + redisMgr.backoffMs;
+}
+
+static void redisMgrFreeReply(void)
+{
+	if (redisMgr.reply != NULL) {
+		freeReplyObject(redisMgr.reply);
+		redisMgr.reply = NULL;
+	}
+}
+
+/* ***************************************************************
+ * Take the shared connection, connecting if needed
+ * return : 0 with the manager locked, -1 (unlocked) if redis is
+ *          unreachable or still in its reconnect backoff
+ *****************************************************************/
+static int redisMgrAcquire(void)
+{
+	unsigned long long nowMs;
+
+	pthread_mutex_lock(&redisMgr.lock);
+	if (redisMgr.ctx != NULL) {
+		return 0;
+	}
+
+	nowMs = getMonoMs();
+	if (nowMs < redisMgr.nextConnectMs) {
+		pthread_mutex_unlock(&redisMgr.lock);
+		return -1;
+	}
+	redisMgr.ctx = redisConnectUnix(REDIS_SOCK);
+	if (redisMgr.ctx == NULL || redisMgr.ctx->err) {
+		TDBG("[MFP] redisConnectUnix() failed, retry in %u ms\n", redisMgr.backoffMs);
+		if (redisMgr.ctx != NULL) {
+			redisFree(redisMgr.ctx);
+			redisMgr.ctx = NULL;
+		}
+		redisMgr.nextConnectMs = nowMs + redisMgr.backoffMs;
+		redisMgr.backoffMs = (redisMgr.backoffMs * 2 > REDIS_RECONNECT_MAX_MS) ? REDIS_RECONNECT_MAX_MS : redisMgr.backoffMs * 2;
+		pthread_mutex_unlock(&redisMgr.lock);
+		return -1;
+	}
+	redisMgr.backoffMs = REDIS_RECONNECT_MIN_MS;
+	TDBG("[MFP] redisConnectUnix() done\n");
 	return 0;
 }
 
+/* free what the caller got and left unread, then give the connection back */
+static void redisMgrRelease(void)
+{
+	redisReply *reply;
+
+	redisMgrFreeReply();
+	while (redisMgr.pending > 0 && redisMgr.ctx != NULL) {
+		redisMgr.pending--;
+		if (redisGetReply(redisMgr.ctx, (void **)&reply) != REDIS_OK) {
+			redisMgrDrop();
+			break;
+		}
+		freeReplyObject(reply);
+	}
+	pthread_mutex_unlock(&redisMgr.lock);
+}
+
+/* run one command; the reply is valid until the next manager call */
+static redisReply *redisMgrCommand(const char *format, ...)
+{
+	va_list ap;
+
+	redisMgrFreeReply();
+	if (redisMgr.ctx == NULL) {
+		return NULL;
+	}
+	va_start(ap, format);
+	redisMgr.reply = redisvCommand(redisMgr.ctx, format, ap);
+	va_end(ap);
+	if (redisMgr.reply == NULL) {
+		redisMgrDrop();
+	}
+	return redisMgr.reply;
+}
+
+/* queue one command of a batch, its reply comes from redisMgrGetReply() */
+static int redisMgrAppend(const char *format, ...)
+{
+	va_list ap;
+	int ret;
+
+	if (redisMgr.ctx == NULL) {
+		return -1;
+	}
+	va_start(ap, format);
+	ret = redisvAppendCommand(redisMgr.ctx, format, ap);
+	va_end(ap);
+	if (ret == REDIS_OK) {
+		redisMgr.pending++;
+	}
+	return ret;
+}
+
+/* reply of the oldest appended command, valid until the next manager call */
+static redisReply *redisMgrGetReply(void)
+{
+	redisMgrFreeReply();
+	if (redisMgr.ctx == NULL || redisMgr.pending == 0) {
+		return NULL;
+	}
+	redisMgr.pending--;
+	if (redisGetReply(redisMgr.ctx, (void **)&redisMgr.reply) != REDIS_OK) {
+		redisMgr.reply = NULL;
+		redisMgrDrop();
+	}
+	return redisMgr.reply;
+}
+
+/* GET a string key through the shared connection; return -1 if it is unavailable */
+static int redisMgrGetString(const char *key, char *buf, size_t len)
+{
+	redisReply *reply;
+	int ret = -1;
+
+	if (redisMgrAcquire() != 0) {
+		return -1;
+	}
+	reply = redisMgrCommand("GET %s", key);
+	if (reply != NULL && reply->str != NULL) {
+		strncpy(buf, reply->str, len - 1);
+		buf[len - 1] = '\0';
+		ret = 0;
+	}
+	redisMgrRelease();
+	return ret;
+}
+
+/* ***************************************************************
+ * Publish the DIMM scores to Redfish. Only scores that changed since
+ * the last successful publish are written; all commands of a report
+ * are pipelined and their replies collected in one round trip. The
+ * first report also sets Id/Name of present slots and deletes the
+ * MemoryMetrics keys of absent ones in the same pipeline.
+ *****************************************************************/
 int genMFPRedfishReport(UINT16 *pDimmID, struct mfp_evaluate_result *pResult, UINT32 count)
 {
 	UINT32 i=0;
 	UINT32 j=0;
-	redisContext *c = NULL;
 	redisReply *reply = NULL;
-    
-	c = redisConnectUnix(REDIS_SOCK);
-	if (c->err)
-	{
-		redisFree(c);
+	INT32 cmdNum = 0;
+	INT32 k, failed = 0;
+
+	for (i=0, j=0; i<(UINT32)memEntryCount; i++) {
+		if ( j<count && i==pDimmID[j]) {
+			if (redfishReportInit == 0 || redfishScore[i] != (INT32)pResult[j].score) {
+				break;
+			}
+			j++;
+		}
+	}
+	if (i == (UINT32)memEntryCount && redfishReportInit) {
+		TDBG("Redfish dimm scores unchanged, no redis round trip\n");
+		return 0;
+	}
+
+	if (redisMgrAcquire() != 0) {
 		return -1;
-	} 
+	}
     
 	for (i=0, j=0; i<(UINT32)memEntryCount; i++) {
-		if ( i==pDimmID[j] && j<count) {
+		if ( j<count && i==pDimmID[j]) {
 			if (redfishReportInit == 0 ) {
 				TDBG("Set attributes for  %s:Memory:%s:MemoryMetrics\n",  env_systems_name, memEntry[i]);
-				reply = redisCommand(c,"SET Redfish:Systems:%s:Memory:%s:MemoryMetrics:Id %s",env_systems_name, memEntry[i], memEntry[i]);
-				if (reply == NULL ) {
-					TCRIT("redis set id fails\n");
-				}
-				reply = redisCommand(c,"SET Redfish:Systems:%s:Memory:%s:MemoryMetrics:Name %s_Metric",env_systems_name, memEntry[i], memEntry[i]);
-				if (reply == NULL ) {
-					TCRIT("redis set name fails\n");
-				}
+				redisMgrAppend("SET Redfish:Systems:%s:Memory:%s:MemoryMetrics:Id %s",env_systems_name, memEntry[i], memEntry[i]);
+				redfishCmdSlot[cmdNum++] = -1;
+				redisMgrAppend("SET Redfish:Systems:%s:Memory:%s:MemoryMetrics:Name %s_Metric",env_systems_name, memEntry[i], memEntry[i]);
+				redfishCmdSlot[cmdNum++] = -1;
+			}
+			if (redfishReportInit == 0 || redfishScore[i] != (INT32)pResult[j].score) {
+				TDBG("result[%d] score = %d \n", j, pResult[j].score);
+				redisMgrAppend("SET Redfish:Systems:%s:Memory:%s:MemoryMetrics:dimm_score %d",env_systems_name, memEntry[i], pResult[j].score);
+				redfishScore[i] = pResult[j].score;
+				redfishCmdSlot[cmdNum++] = i;
 			}
-		    TDBG("result[%d] score = %d \n", j, pResult[j].score);
-			reply = redisCommand(c,"SET Redfish:Systems:%s:Memory:%s:MemoryMetrics:dimm_score %d",env_systems_name, memEntry[i], pResult[j].score);
-		    if (reply == NULL ) {
-		    	TCRIT("redis set score fails\n");
-		    }
 		    j++;
 		}
 		else {
 			if (redfishReportInit == 0 ) {
 				TDBG("Del attributes for  %s:Memory:%s:MemoryMetrics\n",  env_systems_name, memEntry[i]);
-				reply = redisCommand(c,"GET Redfish:Systems:%s:Memory:%s:MemoryMetrics:Id", env_systems_name, memEntry[i]);
-				if (reply != NULL) {
-					redisCommand(c,"DEL Redfish:Systems:%s:Memory:%s:MemoryMetrics:Id", env_systems_name, memEntry[i]);
-				}
-				reply = redisCommand(c,"GET Redfish:Systems:%s:Memory:%s:MemoryMetrics:Name",env_systems_name, memEntry[i]);
-				if (reply != NULL ) {
-					redisCommand(c,"DEL Redfish:Systems:%s:Memory:%s:MemoryMetrics:Name", env_systems_name, memEntry[i]);
-				}
-				reply = redisCommand(c,"GET Redfish:Systems:%s:Memory:%s:MemoryMetrics:dimm_score",env_systems_name, memEntry[i]);
-				if (reply != NULL ) {
-					redisCommand(c,"DEL Redfish:Systems:%s:Memory:%s:MemoryMetrics:dimm_score", env_systems_name, memEntry[i]);
+				redisMgrAppend("DEL Redfish:Systems:%s:Memory:%s:MemoryMetrics:Id Redfish:Systems:%s:Memory:%s:MemoryMetrics:Name Redfish:Systems:%s:Memory:%s:MemoryMetrics:dimm_score",
+						env_systems_name, memEntry[i], env_systems_name, memEntry[i], env_systems_name, memEntry[i]);
+				redfishCmdSlot[cmdNum++] = -1;
+			}
+		}
+	}
+
+	for (k=0; k<cmdNum; k++) {
+		reply = redisMgrGetReply();
+		if (reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+			failed++;
+			/* publish this score again next time */
+			if (redfishCmdSlot[k] >= 0) {
+				redfishScore[redfishCmdSlot[k]] = REDFISH_SCORE_UNKNOWN;
+			}
+		}
+		if (redisMgr.ctx == NULL) {
+			/* the connection is gone, no further replies will come */
+			for (k++; k<cmdNum; k++) {
+				if (redfishCmdSlot[k] >= 0) {
+					redfishScore[redfishCmdSlot[k]] = REDFISH_SCORE_UNKNOWN;
 				}
+				failed++;
 			}
+			break;
 		}
 	}
+	TINFO("Redfish report: %d redis commands in 1 round trip, %d failed\n", cmdNum, failed);
 
-	redfishReportInit = 1;
-	freeReplyObject(reply);
-	redisFree(c);
-	return 0;
+	if (failed) {
+		TCRIT("redis set score fails\n");
+	}
+	else {
+		redfishReportInit = 1;
+	}
+	redisMgrRelease();
+	return failed ? -1 : 0;
 }
 
 #if 0
@@ -319,11 +1186,18 @@ int printMFPReport()
 {
 	FILE *fpRep;
 	ami_mfp_evaluate_result mfpResult;
-	fpRep = fopen(MFP_REPORT,"rb");
+	struct mfp_report_header hdr;
+	fpRep = fopen(MFP_REPORT_V1,"rb");
 	if(fpRep == NULL) {
-		TCRIT("Unable to open %s file\n", MFP_REPORT);
+		TCRIT("Unable to open %s file\n", MFP_REPORT_V1);
+		return -1;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, fpRep) != 1 || hdr.magic != MFP_REPORT_MAGIC) {
+		TCRIT("%s has no report header\n", MFP_REPORT_V1);
+		fclose(fpRep);
 		return -1;
 	}
+	printf("generation %u, %u DIMMs\n", hdr.generation, hdr.count);
 	printf("\n%s\t%s\t%s\t%s\t%s:\t%s\n", "DIMM_ID", "SOCKET", "IMC", "CHANNEL", "SLOT", "SCORE");
 	while (fread(&mfpResult, sizeof(ami_mfp_evaluate_result), 1, fpRep) == 1) {
 		 printf("%u\t%d\t%d\t%d\t%d:\t%d\n", mfpResult.dimmID, mfpResult.result.loc.socket, mfpResult.result.loc.imc, 
@@ -348,6 +1222,9 @@ void mfp_signal_handler(int signum)
 		}		
 	}
 	mfp_fin();
+	if (statMap != NULL) {
+		msync(statMap, STAT_MAP_SIZE, MS_SYNC);
+	}
 
     ProcMonitorDeRegister("/usr/local/bin/mfp");
     unlink("/var/run/mfp.pid" );
@@ -392,20 +1269,567 @@ void mfp_sigusr1_handler(int signum)
 }
 #endif
 
-int AddMFPSELEntries(struct mfp_error *err)
+static unsigned long long elapsedUs(struct timespec *t0, struct timespec *t1)
 {
-	IPMI20_SESSION_T pSession;
-	uint8_t byPrivLevel = PRIV_LEVEL_ADMIN;
-	int wRet;
-	SELOEM1Record_T  OEMSELRec ;
-	AddSELRes_T AddSELRes;
+	return (unsigned long long)(t1->tv_sec - t0->tv_sec) * 1000000ULL + (t1->tv_nsec - t0->tv_nsec) / 1000;
+}
+
+/* ***************************************************************
+ * mfpDataMutex must be held; stamp the last error time and wake
+ * computeMFPThread when a batch becomes non-empty or full. Any other
+ * push only moves the defer deadline later, which needs no wakeup.
+ *****************************************************************/
+static void noteNewErrs(INT32 prevNum, INT32 num)
+{
+	getMonoTime(&tlastErr);
+	if (prevNum == 0 || num >= MAX_NEWERR) {
+		pthread_cond_signal(&mfpDataCond);
+	}
+}
+
+/* switch computeMFPThread between MFP data and MFP validation processing */
+static void setMfpValMode(INT32 valMode)
+{
+	pthread_mutex_lock(&mfpDataMutex);
+	mfpValMode = valMode;
+	pthread_cond_broadcast(&mfpDataCond);
+	pthread_mutex_unlock(&mfpDataMutex);
+}
+
+/* ***************************************************************
+ * Block computeMFPThread until the fill batch is full, the defer
+ * window after the last error expires, the snapshot save is due
+ * or the processing mode changes. The wait conditions match the
+ * checks of the processing loops, so nothing polls while idle.
+ *****************************************************************/
+static void waitMfpDataDue(INT32 valMode)
+{
+	struct timeval tNow;
+	struct timespec deadline;
+	time_t due;
+	INT32 num;
+
+	pthread_mutex_lock(&mfpDataMutex);
+	while (mfpValMode == valMode) {
+		num = valMode ? fillValErrBatch->num : fillErrBatch->num;
+		if (num >= MAX_NEWERR) {
+			break;
+		}
+
+		/* the loops compare whole seconds with '>', the deadline follows suit */
+		due = valMode ? 0 : tlastSave.tv_sec + SNAPSHOT_SAVE_INTERVAL + 1;
+		if (num > 0 && (due == 0 || tlastErr.tv_sec + DATA_PROC_DEFER_TIME + 1 < due)) {
+			due = tlastErr.tv_sec + DATA_PROC_DEFER_TIME + 1;
+		}
 
-	wRet = LIBIPMI_Create_IPMI_Local_Session(&pSession,"","",&byPrivLevel,NULL,AUTH_BYPASS_FLAG,3);
+		if (due == 0) {
+			pthread_cond_wait(&mfpDataCond, &mfpDataMutex);
+			continue;
+		}
+
+		getMonoTime(&tNow);
+		if (tNow.tv_sec >= due) {
+			break;
+		}
+		deadline.tv_sec = due;
+		deadline.tv_nsec = 0;
+		pthread_cond_timedwait(&mfpDataCond, &mfpDataMutex, &deadline);
+	}
+	pthread_mutex_unlock(&mfpDataMutex);
+}
+
+/* ***************************************************************
+ * Lock mfpDataMutex on behalf of an error producer and account
+ * the time spent waiting for it in producerLockWait
+ *****************************************************************/
+static void lockMfpDataProducer(void)
+{
+	struct timespec t0, t1;
+	unsigned long long waitUs;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	pthread_mutex_lock(&mfpDataMutex);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	waitUs = elapsedUs(&t0, &t1);
+	producerLockWait.count++;
+	producerLockWait.totalUs += waitUs;
+	if (waitUs > producerLockWait.maxUs) {
+		producerLockWait.maxUs = waitUs;
+	}
+}
+
+static INT32U overflowPending(struct mfp_overflow *ovf)
+{
+	return ovf->memCount + ovf->spillCount;
+}
+
+/* double the memory FIFO up to OVERFLOW_MEM_MAX_RECS; return -1 if it cannot grow */
+static int growOverflowMem(struct mfp_overflow *ovf)
+{
+	INT32U newCap = ovf->memCap ? ovf->memCap * 2 : OVERFLOW_MEM_INIT_RECS;
+	char *mem;
+
+	if (ovf->memCap >= OVERFLOW_MEM_MAX_RECS) {
+		return -1;
+	}
+	if (newCap > OVERFLOW_MEM_MAX_RECS) {
+		newCap = OVERFLOW_MEM_MAX_RECS;
+	}
+	mem = realloc(ovf->mem, newCap * ovf->recSize);
+	if (mem == NULL) {
+		TCRIT("Unable to grow the overflow queue to %u records\n", newCap);
+		return -1;
+	}
+	ovf->mem = mem;
+	ovf->memCap = newCap;
+	return 0;
+}
+
+/* append records to the spill file; return the number written */
+static int spillOverflow(struct mfp_overflow *ovf, const char *rec, int num)
+{
+	INT32U tail = ovf->spillHead + ovf->spillCount;
+	ssize_t wr;
+
+	if (ovf->spillFd < 0) {
+		/* the spill file is private to this process, unlink it right away */
+		ovf->spillFd = open(ovf->spillPath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if (ovf->spillFd < 0) {
+			TCRIT("Unable to open %s: %s\n", ovf->spillPath, strerror(errno));
+			return 0;
+		}
+		unlink(ovf->spillPath);
+	}
+
+	if (tail + num > OVERFLOW_SPILL_MAX_RECS) {
+		num = OVERFLOW_SPILL_MAX_RECS - tail;
+	}
+	if (num <= 0) {
+		return 0;
+	}
+	wr = pwrite(ovf->spillFd, rec, num * ovf->recSize, (off_t)tail * ovf->recSize);
+	if (wr < 0) {
+		TCRIT("writing %s fails: %s\n", ovf->spillPath, strerror(errno));
+		return 0;
+	}
+	num = wr / ovf->recSize;
+	ovf->spillCount += num;
+	return num;
+}
+
+/* ***************************************************************
+ * Queue records behind a full fill batch, in memory as long as
+ * nothing is spilled behind it, otherwise in the spill file
+ * return : the number queued, the rest is dropped
+ *****************************************************************/
+static int queueOverflow(struct mfp_overflow *ovf, const void *rec, int num)
+{
+	const char *src = rec;
+	int i = 0;
+
+	if (ovf->spillCount == 0) {
+		for (; i<num; i++) {
+			if (ovf->memHead + ovf->memCount >= ovf->memCap) {
+				if (ovf->memHead > 0) {
+					memmove(ovf->mem, ovf->mem + ovf->memHead * ovf->recSize, ovf->memCount * ovf->recSize);
+					ovf->memHead = 0;
+				}
+				else if (growOverflowMem(ovf) != 0) {
+					break;
+				}
+			}
+			memcpy(ovf->mem + (ovf->memHead + ovf->memCount) * ovf->recSize, src + i * ovf->recSize, ovf->recSize);
+			ovf->memCount++;
+		}
+	}
+	if (i < num) {
+		int spilled = spillOverflow(ovf, src + i * ovf->recSize, num - i);
+
+		ovf->stat.spilled += spilled;
+		ovf->stat.dropped += num - i - spilled;
+		if (spilled < num - i) {
+			TWARN("%s is full, drop %d records\n", ovf->spillPath, num - i - spilled);
+		}
+		i += spilled;
+	}
+	ovf->stat.overflowed += i;
+	return i;
+}
+
+/* return the oldest queued record, reading the spill file back when memory is empty */
+static void *overflowHead(struct mfp_overflow *ovf)
+{
+	INT32U num;
+	ssize_t rd;
+
+	if (ovf->memCount == 0) {
+		if (ovf->spillCount == 0) {
+			return NULL;
+		}
+		if (ovf->mem == NULL && growOverflowMem(ovf) != 0) {
+			return NULL;
+		}
+		num = (ovf->spillCount < ovf->memCap) ? ovf->spillCount : ovf->memCap;
+		rd = pread(ovf->spillFd, ovf->mem, num * ovf->recSize, (off_t)ovf->spillHead * ovf->recSize);
+		if (rd < (ssize_t)ovf->recSize) {
+			TCRIT("reading %s fails, drop %u records\n", ovf->spillPath, ovf->spillCount);
+			ovf->stat.dropped += ovf->spillCount;
+			num = ovf->spillCount;
+		}
+		else {
+			num = rd / ovf->recSize;
+			ovf->memHead = 0;
+			ovf->memCount = num;
+		}
+		ovf->spillHead += num;
+		ovf->spillCount -= num;
+		if (ovf->spillCount == 0) {
+			ovf->spillHead = 0;
+			if (ftruncate(ovf->spillFd, 0) != 0) {
+				TWARN("truncating %s fails: %s\n", ovf->spillPath, strerror(errno));
+			}
+		}
+		if (ovf->memCount == 0) {
+			return NULL;
+		}
+	}
+	return ovf->mem + ovf->memHead * ovf->recSize;
+}
+
+static void overflowPop(struct mfp_overflow *ovf)
+{
+	ovf->memHead++;
+	ovf->memCount--;
+	if (ovf->memCount == 0) {
+		ovf->memHead = 0;
+		if (ovf->spillCount == 0) {
+			/* overflow is the exception, do not keep the memory around */
+			free(ovf->mem);
+			ovf->mem = NULL;
+			ovf->memCap = 0;
+		}
+	}
+}
+
+/* copy the overflow counters of MFP data (valMode 0) or MFP validation (1) */
+void getMfpOverflowStat(INT32 valMode, struct mfp_overflow_stat *stat)
+{
+	struct mfp_overflow *ovf = valMode ? &valErrOverflow : &errOverflow;
+
+	pthread_mutex_lock(&mfpDataMutex);
+	memcpy(stat, &ovf->stat, sizeof(*stat));
+	stat->pending = overflowPending(ovf);
+	pthread_mutex_unlock(&mfpDataMutex);
+}
+
+/* errors at the same location and of the same type coalesce; par_syn is kept from the first one */
+static int isSameMfpErr(const struct mfp_error *a, const struct mfp_error *b)
+{
+	return a->socket == b->socket && a->imc == b->imc && a->channel == b->channel
+		&& a->dimm == b->dimm && a->rank == b->rank && a->device == b->device
+		&& a->bank_group == b->bank_group && a->bank == b->bank
+		&& a->row == b->row && a->col == b->col
+		&& a->error_type == b->error_type && a->mode == b->mode;
+}
+
+static INT32U hashMfpErr(const struct mfp_error *err)
+{
+	INT32U h;
+
+	h  = (err->socket << 28) ^ (err->imc << 24) ^ (err->channel << 20) ^ (err->dimm << 16);
+	h ^= (err->rank << 12) ^ (err->device << 6) ^ (err->bank_group << 3) ^ err->bank;
+	h ^= err->row * 0x9E3779B1u;
+	h ^= err->col * 0x85EBCA77u;
+	h ^= h >> 15;
+	return h & (COALESCE_HASH_SIZE - 1);
+}
+
+/* ***************************************************************
+ * mfpDataMutex must be held; merge err into the fill batch record
+ * of the same error or append a new record
+ * return : 1 new record, 0 coalesced, -1 the fill batch is full
+ *****************************************************************/
+static int coalesceNewErr(struct mfp_error *err, time_t now)
+{
+	struct mfp_err_batch *batch = fillErrBatch;
+	INT32U h = hashMfpErr(err);
+	int idx;
+
+	while (batch->hash[h]) {
+		idx = batch->hash[h] - 1;
+		if (isSameMfpErr(&batch->err[idx], err)) {
+			batch->count[idx]++;
+			batch->last[idx] = now;
+			coalesceStat.occurrences++;
+			return 0;
+		}
+		h = (h + 1) & (COALESCE_HASH_SIZE - 1);
+	}
+
+	if (batch->num >= MAX_NEWERR) {
+		return -1;
+	}
+	idx = batch->num++;
+	memcpy(&batch->err[idx], err, sizeof(struct mfp_error));
+	batch->count[idx] = 1;
+	batch->first[idx] = now;
+	batch->last[idx] = now;
+	batch->hash[h] = idx + 1;
+	coalesceStat.occurrences++;
+	coalesceStat.records++;
+	return 1;
+}
+
+/* mfpDataMutex must be held; move queued overflow records into the fill batch while it has room */
+static void refillErrBatch(time_t now)
+{
+	struct mfp_error *err;
+
+	while ((err = overflowHead(&errOverflow)) != NULL) {
+		if (coalesceNewErr(err, now) < 0) {
+			break;
+		}
+		overflowPop(&errOverflow);
+	}
+}
+
+/* mfpDataMutex must be held; move queued overflow records into the fill batch while it has room */
+static void refillValErrBatch(void)
+{
+	mfpval_error *valerr;
+
+	while (fillValErrBatch->num < MAX_NEWERR && (valerr = overflowHead(&valErrOverflow)) != NULL) {
+		memcpy(&fillValErrBatch->err[fillValErrBatch->num++], valerr, sizeof(mfpval_error));
+		overflowPop(&valErrOverflow);
+	}
+}
+
+/* ***************************************************************
+ * mfpDataMutex must be held; push errors in order, into the fill
+ * batch while it has room and nothing is queued in errOverflow,
+ * behind the overflow queue otherwise. newRec[i] (optional) is set
+ * for an error that opened a new record, i.e. the first occurrence
+ * in this batch; queued errors always count as new.
+ * Coalesced repeats do not move the defer deadline, so a storm of
+ * known errors cannot postpone evaluation indefinitely.
+ * return : the number of errors taken, the rest was dropped
+ *****************************************************************/
+static int pushNewErrs(struct mfp_error *err, int num, INT8U *newRec)
+{
+	INT32 prevNum = fillErrBatch->num;
+	time_t now = time(0);
+	int i, k, ret;
+
+	refillErrBatch(now);
+	for (i=0; i<num && overflowPending(&errOverflow) == 0; i++) {
+		ret = coalesceNewErr(&err[i], now);
+		if (ret < 0) {
+			break;
+		}
+		if (newRec) {
+			newRec[i] = (INT8U)ret;
+		}
+	}
+	if (i < num) {
+		k = i;
+		i += queueOverflow(&errOverflow, &err[i], num - i);
+		for (; newRec && k<num; k++) {
+			newRec[k] = 1;
+		}
+	}
+	if (fillErrBatch->num != prevNum) {
+		noteNewErrs(prevNum, fillErrBatch->num);
+	}
+	return i;
+}
+
+/* mfpDataMutex must be held; same as pushNewErrs() without coalescing */
+static int pushNewValErrs(mfpval_error *valerr, int num)
+{
+	INT32 prevNum = fillValErrBatch->num;
+	int i = 0;
+
+	refillValErrBatch();
+	if (overflowPending(&valErrOverflow) == 0) {
+		i = MAX_NEWERR - fillValErrBatch->num;
+		if (i > num) {
+			i = num;
+		}
+		memcpy(&fillValErrBatch->err[fillValErrBatch->num], valerr, i * sizeof(mfpval_error));
+		fillValErrBatch->num += i;
+	}
+	if (i < num) {
+		i += queueOverflow(&valErrOverflow, &valerr[i], num - i);
+	}
+	if (fillValErrBatch->num != prevNum) {
+		noteNewErrs(prevNum, fillValErrBatch->num);
+	}
+	return i;
+}
+
+/* mfpDataMutex must be held; return -1 if the error is dropped */
+static int pushNewErr(struct mfp_error *err)
+{
+	return (pushNewErrs(err, 1, NULL) == 1) ? 0 : -1;
+}
+
+/* mfpDataMutex must be held; return -1 if the error is dropped */
+static int pushNewValErr(mfpval_error *valerr)
+{
+	return (pushNewValErrs(valerr, 1) == 1) ? 0 : -1;
+}
+
+/* mfpDataMutex must be held; detach the fill batch and start a new one */
+static struct mfp_err_batch *swapErrBatch(void)
+{
+	struct mfp_err_batch *batch = fillErrBatch;
+
+	fillErrBatch = (batch == &errBatch[0]) ? &errBatch[1] : &errBatch[0];
+	fillErrBatch->num = 0;
+	memset(fillErrBatch->hash, 0, sizeof(fillErrBatch->hash));
+	refillErrBatch(time(0));
+	if (fillErrBatch->num) {
+		noteNewErrs(0, fillErrBatch->num);
+	}
+	return batch;
+}
+
+/* mfpDataMutex must be held; detach the fill batch and start a new one */
+static struct mfp_valerr_batch *swapValErrBatch(void)
+{
+	struct mfp_valerr_batch *batch = fillValErrBatch;
+
+	fillValErrBatch = (batch == &valErrBatch[0]) ? &valErrBatch[1] : &valErrBatch[0];
+	fillValErrBatch->num = 0;
+	refillValErrBatch();
+	if (fillValErrBatch->num) {
+		noteNewErrs(0, fillValErrBatch->num);
+	}
+	return batch;
+}
+
+/* mfpDataMutex must be held */
+static void reportProducerLockWait(void)
+{
+	if (producerLockWait.count) {
+		TINFO("producer lock wait: %u locks, avg %llu us, max %llu us\n", producerLockWait.count,
+				producerLockWait.totalUs / producerLockWait.count, producerLockWait.maxUs);
+	}
+	memset(&producerLockWait, 0, sizeof(producerLockWait));
+}
+
+/* mfpDataMutex must be held */
+static void reportOverflowStat(struct mfp_overflow *ovf)
+{
+	if (ovf->stat.overflowed || ovf->stat.dropped) {
+		TINFO("%s overflow: %llu queued, %llu spilled, %llu dropped, %u pending\n",
+				ovf == &errOverflow ? "MFP data" : "MFP validation",
+				ovf->stat.overflowed, ovf->stat.spilled, ovf->stat.dropped, overflowPending(ovf));
+	}
+}
+
+/* mfpDataMutex must be held */
+static void reportCoalesceStat(void)
+{
+	if (coalesceStat.records) {
+		TINFO("error coalescing: %llu errors in %llu records, ratio %llu.%02llu\n",
+				coalesceStat.occurrences, coalesceStat.records,
+				coalesceStat.occurrences / coalesceStat.records,
+				(coalesceStat.occurrences % coalesceStat.records) * 100 / coalesceStat.records);
+	}
+}
+
+/* ***************************************************************
+ * Evaluate a coalesced batch with every occurrence expanded again,
+ * so the engine statistics match the uncoalesced error stream.
+ * The engine sees at most MAX_NEWERR errors per call.
+ * return : MFP_OK or the first engine error
+ *****************************************************************/
+static int evaluateErrBatch(struct mfp_err_batch *batch)
+{
+	static struct mfp_error chunk[MAX_NEWERR];
+	int retVal = MFP_OK, ret;
+	int i, n = 0;
+	INT32U k;
+
+	for (i=0; i<batch->num; i++) {
+#ifdef DEBUG
+		if (batch->count[i] > 1) {
+			TDBG("\t[%d] coalesced %u errors in %ld seconds\n", i, batch->count[i],
+					(long)(batch->last[i] - batch->first[i]));
+		}
+#endif
+		for (k=0; k<batch->count[i]; k++) {
+			memcpy(&chunk[n++], &batch->err[i], sizeof(struct mfp_error));
+			if (n == MAX_NEWERR) {
+				ret = mfp_evaluate_dimm(time(0), n, chunk, dimmCount, results);
+				if (retVal == MFP_OK) {
+					retVal = ret;
+				}
+				n = 0;
+			}
+		}
+	}
+	if (n > 0 || batch->num == 0) {
+		ret = mfp_evaluate_dimm(time(0), n, chunk, dimmCount, results);
+		if (retVal == MFP_OK) {
+			retVal = ret;
+		}
+	}
+	return retVal;
+}
+
+/* selSessionMutex must be held */
+static int openSelSession(void)
+{
+	uint8_t byPrivLevel = PRIV_LEVEL_ADMIN;
+	struct timespec t0, t1;
+	int wRet;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	wRet = LIBIPMI_Create_IPMI_Local_Session(&selSession,"","",&byPrivLevel,NULL,AUTH_BYPASS_FLAG,3);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	selStat.opens++;
+	selStat.openUs += elapsedUs(&t0, &t1);
 	if(wRet != LIBIPMI_E_SUCCESS) {
 		TCRIT("Cannot Establish IPMI Local Session\n");
 		return -1;
 	}
+	selSessionOpen = 1;
+	return 0;
+}
+
+/* selSessionMutex must be held */
+static void closeSelSession(void)
+{
+	if (selSessionOpen) {
+		LIBIPMI_CloseSession(&selSession);
+		selSessionOpen = 0;
+	}
+}
 
+/* log the SEL insert latency and session setup cost, then reset them */
+static void reportSelLatency(void)
+{
+	pthread_mutex_lock(&selSessionMutex);
+	if (selStat.count) {
+		TINFO("SEL insert: %u entries, avg %llu us, max %llu us; %u session opens, avg %llu us\n",
+				selStat.count, selStat.totalUs / selStat.count, selStat.maxUs,
+				selStat.opens, selStat.opens ? selStat.openUs / selStat.opens : 0);
+	}
+	memset(&selStat, 0, sizeof(selStat));
+	pthread_mutex_unlock(&selSessionMutex);
+
+	pthread_mutex_lock(&selQueueMutex);
+	if (selQueueDropped) {
+		TINFO("SEL queue: %llu entries dropped\n", selQueueDropped);
+	}
+	pthread_mutex_unlock(&selQueueMutex);
+}
+
+static void buildMFPSELRecord(struct mfp_error *err, SELOEM1Record_T *pRec)
+{
     /*
      * 	OEM Rec Type 0xC4
      *	OEMData[0] : SOCKET, Bit7-5; IMC, Bit4-3; CHANNEL, Bit2-1 
@@ -416,21 +1840,293 @@ int AddMFPSELEntries(struct mfp_error *err)
      *	OEMData[4] : least significant 4 bits of Column for ddr5 for MRT3
      */
     
-	OEMSELRec.ID = 0x00;
-	OEMSELRec.Type = MEMORYFAILURE_OEMRECTYPE;
-	OEMSELRec.TimeStamp = time(NULL);
-	OEMSELRec.OEMData[0] = (err->socket<<SEL_SOCKET_SHFT) | (err->imc<<SEL_IMC_SHFT) | (err->channel<<SEL_CHAN_SHFT);
-	OEMSELRec.OEMData[1] = (err->dimm<<SEL_DIMM_SHFT) | (err->rank<<SEL_RANK_SHFT);
-	OEMSELRec.OEMData[2] = (err->bank_group<<SEL_BG_SHFT) | (err->bank<<SEL_BANK_SHFT)|(err->error_type<<SEL_ERRT_SHFT);
-	OEMSELRec.OEMData[3] = (err->col >>SEL_COL_RSHFT ) & 0xFF;
-	OEMSELRec.OEMData[4] = (err->col & ( ~(0xFF<<SEL_COL_RSHFT))) << (8-SEL_COL_RSHFT);
-	//add the SEL entry
-	wRet = IPMICMD_AddSELEntry (&pSession, (SELEventRecord_T *) &OEMSELRec, &AddSELRes, 3 );
-    if (( wRet == LIBIPMI_E_SUCCESS ) && ( AddSELRes.CompletionCode == CC_SUCCESS ))  {
+	pRec->ID = 0x00;
+	pRec->Type = MEMORYFAILURE_OEMRECTYPE;
+	pRec->TimeStamp = time(NULL);
+	pRec->OEMData[0] = (err->socket<<SEL_SOCKET_SHFT) | (err->imc<<SEL_IMC_SHFT) | (err->channel<<SEL_CHAN_SHFT);
+	pRec->OEMData[1] = (err->dimm<<SEL_DIMM_SHFT) | (err->rank<<SEL_RANK_SHFT);
+	pRec->OEMData[2] = (err->bank_group<<SEL_BG_SHFT) | (err->bank<<SEL_BANK_SHFT)|(err->error_type<<SEL_ERRT_SHFT);
+	pRec->OEMData[3] = (err->col >>SEL_COL_RSHFT ) & 0xFF;
+	pRec->OEMData[4] = (err->col & ( ~(0xFF<<SEL_COL_RSHFT))) << (8-SEL_COL_RSHFT);
+}
+
+/* ***************************************************************
+ * selSessionMutex must be held; add one SEL record through the
+ * shared local IPMI session. The session is opened on first use
+ * and kept; a failing request closes it and is retried once on a
+ * new session.
+ *****************************************************************/
+static int addSelRecord(SELOEM1Record_T *pRec)
+{
+	int wRet = -1;
+	int retry;
+	AddSELRes_T AddSELRes;
+	struct timespec t0, t1;
+	unsigned long long us;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (retry=0; retry<2; retry++) {
+		if (!selSessionOpen && openSelSession() != 0) {
+			break;
+		}
+		//add the SEL entry
+		wRet = IPMICMD_AddSELEntry (&selSession, (SELEventRecord_T *) pRec, &AddSELRes, 3 );
+		if (wRet == LIBIPMI_E_SUCCESS) {
+			break;
+		}
+		TWARN("Adding MFP SEL entry fails %d, reopen IPMI Local Session\n", wRet);
+		closeSelSession();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	us = elapsedUs(&t0, &t1);
+	selStat.count++;
+	selStat.totalUs += us;
+	if (us > selStat.maxUs) {
+		selStat.maxUs = us;
+	}
+
+	if (wRet != LIBIPMI_E_SUCCESS) {
+		return -1;
+	}
+    if ( AddSELRes.CompletionCode == CC_SUCCESS )  {
     	TDBG ("MFP EVENT Logged successfully\n");
 	}
-    LIBIPMI_CloseSession(&pSession);
-    return 0;
+    return 0;
+}
+
+/* add num prepared SEL records in one session lock; return the number logged */
+static int addSelRecords(SELOEM1Record_T *pRec, int num)
+{
+	int i, logged = 0;
+
+	pthread_mutex_lock(&selSessionMutex);
+	for (i=0; i<num; i++) {
+		if (addSelRecord(&pRec[i]) == 0) {
+			logged++;
+		}
+	}
+	pthread_mutex_unlock(&selSessionMutex);
+	return logged;
+}
+
+/* log num MFP errors as OEM SEL records in one session lock; return the number logged */
+int AddMFPSELEntries(struct mfp_error *err, int num)
+{
+	SELOEM1Record_T  OEMSELRec ;
+	int i, logged = 0;
+
+	pthread_mutex_lock(&selSessionMutex);
+	for (i=0; i<num; i++) {
+		buildMFPSELRecord(&err[i], &OEMSELRec);
+		if (addSelRecord(&OEMSELRec) == 0) {
+			logged++;
+		}
+	}
+	pthread_mutex_unlock(&selSessionMutex);
+	return logged;
+}
+
+/* ***************************************************************
+ * selQueueMutex must be held; account err to its DIMM and tell
+ * whether it is covered by a summary record instead of its own
+ *****************************************************************/
+static int aggregateSelEntry(struct mfp_error *err, time_t now)
+{
+	struct mfp_sel_agg *agg = NULL;
+	int k;
+
+	if (SEL_AGG_THRESHOLD == 0) {
+		return 0;
+	}
+	for (k=0; k<selAggCount; k++) {
+		if (selAgg[k].socket == err->socket && selAgg[k].imc == err->imc
+				&& selAgg[k].channel == err->channel && selAgg[k].dimm == err->dimm) {
+			agg = &selAgg[k];
+			break;
+		}
+	}
+	if (agg == NULL) {
+		if (selAggCount >= MAX_DIMM_COUNT) {
+			return 0;
+		}
+		agg = &selAgg[selAggCount++];
+		memset(agg, 0, sizeof(*agg));
+		agg->socket = err->socket;
+		agg->imc = err->imc;
+		agg->channel = err->channel;
+		agg->dimm = err->dimm;
+	}
+
+	agg->count++;
+	if (!agg->aggregating && agg->count <= SEL_AGG_THRESHOLD) {
+		return 0;
+	}
+	if (!agg->aggregating) {
+		agg->aggregating = 1;
+		TINFO("SEL aggregation on for dimm %u-%u-%u-%u\n", agg->socket, agg->imc, agg->channel, agg->dimm);
+	}
+	if (agg->suppressed == 0) {
+		agg->first = now;
+	}
+	agg->suppressed++;
+	agg->last = now;
+	return 1;
+}
+
+static INT16U saturate16(unsigned long val)
+{
+	return (val > 0xFFFF) ? 0xFFFF : (INT16U)val;
+}
+
+/* ***************************************************************
+ * selQueueMutex must be held; close the aggregation window: build
+ * a summary record for every DIMM with suppressed errors and reset
+ * the window counts
+ * return : number of records built in pRec
+ *****************************************************************/
+static int closeSelAggWindow(SELOEM1Record_T *pRec)
+{
+	struct mfp_sel_agg *agg;
+	INT16U count, span;
+	int k, num = 0;
+
+	for (k=0; k<selAggCount; k++) {
+		agg = &selAgg[k];
+		if (agg->suppressed) {
+			count = saturate16(agg->suppressed);
+			span = saturate16(agg->last - agg->first);
+			memset(&pRec[num], 0, sizeof(SELOEM1Record_T));
+			pRec[num].Type = MEMORYFAILURE_SUMMARY_OEMRECTYPE;
+			pRec[num].TimeStamp = time(NULL);
+			pRec[num].OEMData[0] = (agg->socket<<SEL_SOCKET_SHFT) | (agg->imc<<SEL_IMC_SHFT) | (agg->channel<<SEL_CHAN_SHFT);
+			pRec[num].OEMData[1] = (agg->dimm<<SEL_DIMM_SHFT);
+			pRec[num].OEMData[2] = count & 0xFF;
+			pRec[num].OEMData[3] = count >> 8;
+			pRec[num].OEMData[4] = span & 0xFF;
+			pRec[num].OEMData[5] = span >> 8;
+			num++;
+		}
+		if (agg->aggregating && agg->count <= SEL_AGG_THRESHOLD) {
+			agg->aggregating = 0;
+			TINFO("SEL aggregation off for dimm %u-%u-%u-%u\n", agg->socket, agg->imc, agg->channel, agg->dimm);
+		}
+		agg->count = 0;
+		agg->suppressed = 0;
+	}
+	return num;
+}
+
+/* ***************************************************************
+ * Queue the errors flagged in newRec (all of them if NULL) for
+ * selWriterThread, applying MFP_SEL_QUEUE_POLICY on a full queue
+ * return : number of errors queued
+ *****************************************************************/
+int queueMFPSELEntries(struct mfp_error *err, INT8U *newRec, int num)
+{
+	int i, queued = 0, dropped = 0;
+	struct timeval tNow;
+
+	getMonoTime(&tNow);
+	pthread_mutex_lock(&selQueueMutex);
+	for (i=0; i<num; i++) {
+		/* coalesced repeats are never logged, so they do not count toward a summary either */
+		if (newRec && !newRec[i]) {
+			continue;
+		}
+		if (aggregateSelEntry(&err[i], tNow.tv_sec)) {
+			continue;
+		}
+		if (selQueueCount == SEL_QUEUE_LEN) {
+#if MFP_SEL_QUEUE_POLICY == SEL_QUEUE_BLOCK
+			pthread_cond_signal(&selQueueCond);
+			while (selQueueCount == SEL_QUEUE_LEN) {
+				pthread_cond_wait(&selQueueSpaceCond, &selQueueMutex);
+			}
+#elif MFP_SEL_QUEUE_POLICY == SEL_QUEUE_DROP_OLDEST
+			selQueueHead = (selQueueHead + 1) % SEL_QUEUE_LEN;
+			selQueueCount--;
+			dropped++;
+#else
+			dropped++;
+			continue;
+#endif
+		}
+		memcpy(&selQueue[(selQueueHead + selQueueCount) % SEL_QUEUE_LEN], &err[i], sizeof(struct mfp_error));
+		selQueueCount++;
+		queued++;
+	}
+	selQueueDropped += dropped;
+	if (queued) {
+		pthread_cond_signal(&selQueueCond);
+	}
+	pthread_mutex_unlock(&selQueueMutex);
+
+	if (dropped) {
+		TWARN("SEL queue is full, drop %d entries\n", dropped);
+	}
+	return queued;
+}
+
+/* ***************************************************************
+ * Write the queued MFP SEL entries in batches of SEL_WRITE_BATCH,
+ * so SEL throughput does not depend on the producers
+ *****************************************************************/
+void *selWriterThread(void *pArg)
+{
+	static struct mfp_error batch[SEL_WRITE_BATCH];
+	static SELOEM1Record_T summary[MAX_DIMM_COUNT];
+	struct timeval tNow;
+	struct timespec deadline;
+	sigset_t mask;
+	int num, i;
+
+	UN_USED(pArg);
+	sigfillset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+	prctl(PR_SET_NAME,__FUNCTION__,0,0,0);
+
+	getMonoTime(&tNow);
+	selAggWindowStart = tNow.tv_sec;
+
+	while (1) {
+		pthread_mutex_lock(&selQueueMutex);
+		while (selQueueCount == 0) {
+			getMonoTime(&tNow);
+			if (SEL_AGG_THRESHOLD != 0 && tNow.tv_sec >= selAggWindowStart + SEL_AGG_WINDOW) {
+				break;
+			}
+			if (SEL_AGG_THRESHOLD == 0) {
+				pthread_cond_wait(&selQueueCond, &selQueueMutex);
+				continue;
+			}
+			deadline.tv_sec = selAggWindowStart + SEL_AGG_WINDOW;
+			deadline.tv_nsec = 0;
+			pthread_cond_timedwait(&selQueueCond, &selQueueMutex, &deadline);
+		}
+
+		getMonoTime(&tNow);
+		if (SEL_AGG_THRESHOLD != 0 && tNow.tv_sec >= selAggWindowStart + SEL_AGG_WINDOW) {
+			selAggWindowStart = tNow.tv_sec;
+			num = closeSelAggWindow(summary);
+			if (num) {
+				pthread_mutex_unlock(&selQueueMutex);
+				addSelRecords(summary, num);
+				continue;
+			}
+		}
+
+		num = (selQueueCount < SEL_WRITE_BATCH) ? selQueueCount : SEL_WRITE_BATCH;
+		for (i=0; i<num; i++) {
+			memcpy(&batch[i], &selQueue[selQueueHead], sizeof(struct mfp_error));
+			selQueueHead = (selQueueHead + 1) % SEL_QUEUE_LEN;
+		}
+		selQueueCount -= num;
+		pthread_cond_broadcast(&selQueueSpaceCond);
+		pthread_mutex_unlock(&selQueueMutex);
+
+		AddMFPSELEntries(batch, num);
+	}
+	return NULL;
 }
 
 void *computeMFPThread(void *pArg) 
@@ -453,6 +2149,10 @@ void *computeMFPThread(void *pArg)
 	int pnLen = 0;
 	struct mfp_part_number pnVal;
 	struct mfp_stat_result mfpStatResult;
+	struct mfp_err_batch *evalBatch = NULL;
+	struct mfp_valerr_batch *evalValBatch = NULL;
+	INT32 fillNum;
+	time_t lastErrSec;
 
 	UN_USED(pArg);
 	sigfillset(&mask);
@@ -461,7 +2161,7 @@ void *computeMFPThread(void *pArg)
 
 DATA_PROC:
 	while (1) {
-		if ( access( MFP_VAL_KEY, F_OK ) == 0 ) {
+		if ( mfpValMode ) {
 			TINFO("Found %s, Exit MFP Data Process Loop\n", MFP_VAL_KEY);
 			errno = 0;
 			if (inited != 0) {
@@ -515,11 +2215,12 @@ DATA_PROC:
 #endif
 		    if(retVal != MFP_OK) {
 		        TCRIT("\tStep 1: mfp_init meet error, ret=%d\n", retVal);
+		        endStage(STAGE_ENGINE, 0);
 		        free(results);
 		        return NULL;
 		    }
 		    
-            retVal = mfp_evaluate_dimm(time(0), 0, newErr, dimmCount, results);
+            retVal = mfp_evaluate_dimm(time(0), 0, errBatch[0].err, dimmCount, results);
             if(retVal != MFP_OK) {
                 TCRIT("mfp_evaluate_dimm meet error, retVal=%d\n", retVal);
             }
@@ -527,30 +2228,43 @@ DATA_PROC:
 			genMFPRedfishReport(dimmID, results, dimmCount);
 		    inited = 1;
 		    TINFO("MFP Engine Initialized, MFP report generated for %u DIMMs\n", dimmCount);
+		    endStage(STAGE_ENGINE, 1);
 		}
 		
-		if (newErrNum > 0 ) {
-			TDBG("newErrNum = %d \n", newErrNum);
-			gettimeofday(&tCur, NULL);
-
-			if ( ((tCur.tv_sec-tlastErr.tv_sec) > DATA_PROC_DEFER_TIME)  || (newErrNum >= MAX_NEWERR)) {
-				TDBG(" tCur.tv_sec is %u tlastErr.tv_sec %u \n", (unsigned int)tCur.tv_sec, (unsigned int)tlastErr.tv_sec);
+		/* producers update the fill batch and tlastErr under mfpDataMutex */
+		pthread_mutex_lock(&mfpDataMutex);
+		fillNum = fillErrBatch->num;
+		lastErrSec = tlastErr.tv_sec;
+		pthread_mutex_unlock(&mfpDataMutex);
+		if (fillNum > 0 ) {
+			TDBG("newErrNum = %d \n", fillNum);
+			getMonoTime(&tCur);
+
+			if ( ((tCur.tv_sec-lastErrSec) > DATA_PROC_DEFER_TIME)  || (fillNum >= MAX_NEWERR)) {
+				TDBG(" tCur.tv_sec is %u tlastErr.tv_sec %u \n", (unsigned int)tCur.tv_sec, (unsigned int)lastErrSec);
 
-				TINFO("process %d mfp data in single evaluation\n", newErrNum);
 				pthread_mutex_lock(&mfpDataMutex);
-	            retVal = mfp_evaluate_dimm(time(0), newErrNum, newErr, dimmCount, results);
+				evalBatch = swapErrBatch();
+				reportProducerLockWait();
+				reportCoalesceStat();
+				reportOverflowStat(&errOverflow);
+				pthread_mutex_unlock(&mfpDataMutex);
+				reportSelLatency();
+
+				TINFO("process %d mfp data in single evaluation\n", evalBatch->num);
+	            retVal = evaluateErrBatch(evalBatch);
 	            if(retVal != MFP_OK) {
 	                TCRIT("mfp_evaluate_dimm meet error, retVal=%d\n", retVal);
 	            }
-	            
-	            newShadowErrNum = newErrNum;
-				newErrNum = 0;
+
+				pthread_mutex_lock(&mfpDataMutex);
+	            newShadowErrNum = evalBatch->num;
 				pthread_mutex_unlock(&mfpDataMutex);
 				TDBG("get newShadowErrNum %d\n", newShadowErrNum);
 				
 #if defined(DEBUG)
 				TDBG("after results0 =%u result1=%u\n", results[0].score, results[1].score);
-				gettimeofday(&tEval, NULL);
+				getMonoTime(&tEval);
 				if ( tEval.tv_usec > tCur.tv_usec) {
 					evaluSec = tEval.tv_usec - tCur.tv_usec;
 					evalSec = tEval.tv_sec - tCur.tv_sec;
@@ -566,7 +2280,7 @@ DATA_PROC:
 			}			
 		}
 
-		gettimeofday(&tCur, NULL);
+		getMonoTime(&tCur);
 
 		if ((tCur.tv_sec-tlastSave.tv_sec) > SNAPSHOT_SAVE_INTERVAL) {
 			tlastSave.tv_sec = tCur.tv_sec;
@@ -589,16 +2303,15 @@ DATA_PROC:
 	        	mfp_stat(dimmArray[i].loc, &mfpStatResult);
 	        	updateStatResult(dimmArray[i].loc, &mfpStatResult);
 	        }
+	        flushStatResult(1);
 		}
 
-		if ( newErrNum < SLEEP_THRESH ) {
-			sleep(DATA_REC_SLEEP);
-		}
+		waitMfpDataDue(0);
 	}
 	
 	while (1)
 	{
-		if ( access( MFP_VAL_KEY, F_OK ) != 0 ) {
+		if ( !mfpValMode ) {
 			TINFO("Not Found %s, Exit MFP Validation Data Process Loop\n", MFP_VAL_KEY);
 			errno = 0;
 			if (valInited != 0 ) {			
@@ -649,6 +2362,7 @@ DATA_PROC:
 #endif
 		    if(retVal != MFP_OK) {
 		        TCRIT("\tStep 1: mfp_init meet error, ret=%d\n", retVal);
+		        endStage(STAGE_ENGINE, 0);
 		        if(results != NULL) {
 		        	free(results);
 		        }
@@ -656,28 +2370,36 @@ DATA_PROC:
 		    }
 		    errTotal = 0;
 		    valInited = 1;
+		    endStage(STAGE_ENGINE, 1);
 		}
 		
-		TDBG("newValErrNum = %d \n", newValErrNum);
-		if (newValErrNum > 0 ) {
-			gettimeofday(&tCur, NULL);
+		pthread_mutex_lock(&mfpDataMutex);
+		fillNum = fillValErrBatch->num;
+		lastErrSec = tlastErr.tv_sec;
+		pthread_mutex_unlock(&mfpDataMutex);
+		TDBG("newValErrNum = %d \n", fillNum);
+		if (fillNum > 0 ) {
+			getMonoTime(&tCur);
 
-			if ( ((tCur.tv_sec-tlastErr.tv_sec) > DATA_PROC_DEFER_TIME)  || (newValErrNum >= MAX_NEWERR)) {
+			if ( ((tCur.tv_sec-lastErrSec) > DATA_PROC_DEFER_TIME)  || (fillNum >= MAX_NEWERR)) {
 
-				TDBG(" tCur.tv_sec is %u tlastErr.tv_sec %u \n", (unsigned int)tCur.tv_sec, (unsigned int)tlastErr.tv_sec);
-				TDBG("process %d mfp validation error data one by one\n", newValErrNum);
+				TDBG(" tCur.tv_sec is %u tlastErr.tv_sec %u \n", (unsigned int)tCur.tv_sec, (unsigned int)lastErrSec);
 				pthread_mutex_lock(&mfpDataMutex);
-				errNumTmp = newValErrNum;
+				evalValBatch = swapValErrBatch();
+				reportProducerLockWait();
+				reportOverflowStat(&valErrOverflow);
+				pthread_mutex_unlock(&mfpDataMutex);
+
+				TDBG("process %d mfp validation error data one by one\n", evalValBatch->num);
+				errNumTmp = evalValBatch->num;
 				errTotal += errNumTmp;
-				for ( i=0; i< newValErrNum; i++ ) {
-					timeTmp = newValErr[i].timestamp;
-					retVal = mfp_evaluate_dimm(timeTmp, 1, &newValErr[i].valerr, dimmCount, results);
+				for ( i=0; i< evalValBatch->num; i++ ) {
+					timeTmp = evalValBatch->err[i].timestamp;
+					retVal = mfp_evaluate_dimm(timeTmp, 1, &evalValBatch->err[i].valerr, dimmCount, results);
 					if(retVal != MFP_OK) {
 						TCRIT("mfp_evaluate_dimm meet error, retVal=%d\n", retVal);
 					}
 				}
-				newValErrNum = 0;
-				pthread_mutex_unlock(&mfpDataMutex);
 				
 				printf("After %d errors:\n", errTotal);
 				for ( i = 0; i< (int)dimmCount; i++) {
@@ -686,7 +2408,7 @@ DATA_PROC:
 					}
 				}
 
-				gettimeofday(&tEval, NULL);
+				getMonoTime(&tEval);
 				if ( tEval.tv_usec > tCur.tv_usec) {
 					evaluSec = tEval.tv_usec - tCur.tv_usec;
 					evalSec = tEval.tv_sec - tCur.tv_sec;
@@ -699,9 +2421,7 @@ DATA_PROC:
 			}
 		}
 
-		if ( newValErrNum < SLEEP_THRESH ) {
-			sleep(DATA_REC_SLEEP);
-		}
+		waitMfpDataDue(1);
 	} /* while(1) */
 
     return NULL;
@@ -884,52 +2604,119 @@ int getNewFaultsFromRecent(struct mfp_component *anchorFault, struct mfp_compone
 	return 0;
 }
 
+/*
+ * Hash index over rowFault[] or cellFault[]. A fault is keyed by its
+ * location packed into 64 bits, the column only for cell faults; a key
+ * match is confirmed field by field, so the key does not have to be exact.
+ * Faults are only ever appended, slots hold the fault position + 1, wide
+ * enough for any position below MAX_TOTAL_FAULT_NUM. Duplicated records
+ * are indexed too; a lookup finds the first one.
+ */
+#define FAULT_INDEX_SIZE	(MAX_TOTAL_FAULT_NUM * 2)
+
+struct mfp_fault_index {
+	struct mfp_component	*faults;
+	faultType				fType;
+	int						count;
+	unsigned long long		key[FAULT_INDEX_SIZE];
+	INT32U					pos[FAULT_INDEX_SIZE];
+};
+
+static unsigned long long faultKey(const struct mfp_component *f, faultType fType)
+{
+	unsigned long long key;
+
+	key = (unsigned long long)(f->socket & 0xF)
+		| (unsigned long long)(f->imc & 0xF) << 4
+		| (unsigned long long)(f->channel & 0xF) << 8
+		| (unsigned long long)(f->dimm & 0x3) << 12
+		| (unsigned long long)(f->rank & 0xF) << 14
+		| (unsigned long long)(f->device & 0x3F) << 18
+		| (unsigned long long)(f->bank_group & 0xF) << 24
+		| (unsigned long long)(f->bank & 0xF) << 28
+		| (unsigned long long)(f->row & 0xFFFFF) << 32;
+	if (fType == CELLFAULT) {
+		key |= (unsigned long long)(f->col & 0xFFF) << 52;
+	}
+	return key;
+}
+
+static int isSameFault(const struct mfp_component *a, const struct mfp_component *b, faultType fType)
+{
+	if (a->socket==b->socket
+			&& a->imc==b->imc
+			&& a->channel==b->channel
+			&& a->dimm==b->dimm
+			&& a->rank==b->rank
+			&& a->device==b->device
+			&& a->bank_group==b->bank_group
+			&& a->bank==b->bank
+			&& a->row==b->row) {
+		return (fType == ROWFAULT || a->col==b->col);
+	}
+	return 0;
+}
+
+static void faultIndexInit(struct mfp_fault_index *index, struct mfp_component *faults, faultType fType)
+{
+	memset(index, 0, sizeof(*index));
+	index->faults = faults;
+	index->fType = fType;
+}
+
+static int faultIndexHas(const struct mfp_fault_index *index, const struct mfp_component *f)
+{
+	unsigned long long key = faultKey(f, index->fType);
+	INT32U i = (INT32U)((key * 0x9E3779B97F4A7C15ULL) >> 32) % FAULT_INDEX_SIZE;
+
+	while (index->pos[i] != 0) {
+		if (index->key[i] == key && isSameFault(&index->faults[index->pos[i]-1], f, index->fType)) {
+			return 1;
+		}
+		i = (i + 1) % FAULT_INDEX_SIZE;
+	}
+	return 0;
+}
+
+/* index faults[pos], which the caller has just stored */
+static void faultIndexAdd(struct mfp_fault_index *index, int pos)
+{
+	unsigned long long key = faultKey(&index->faults[pos], index->fType);
+	INT32U i = (INT32U)((key * 0x9E3779B97F4A7C15ULL) >> 32) % FAULT_INDEX_SIZE;
+
+	if (index->count >= FAULT_INDEX_SIZE / 2) {
+		TCRIT("fault index full\n");
+		return;
+	}
+	while (index->pos[i] != 0) {
+		i = (i + 1) % FAULT_INDEX_SIZE;
+	}
+	index->key[i] = key;
+	index->pos[i] = (INT32U)(pos + 1);
+	index->count++;
+}
+
+static struct mfp_fault_index rowFaultIndex;
+static struct mfp_fault_index cellFaultIndex;
+
 /*********************************************************************************
  * This API may be redundant because if API mfp_recent_faults() works as expected, 
  * the fault record should not have a same copy as new fault 
  * This API performs an extra check
  *********************************************************************************/
-int filterNewFaultByExistFault(struct mfp_component *faultToDate, int FaultNumToDate, 
+int filterNewFaultByExistFault(struct mfp_fault_index *index,
 		struct mfp_component *outFault, int *outFaultNum,
-		struct mfp_component *newFault, int newFaultNum, faultType fType)
+		struct mfp_component *newFault, int newFaultNum)
 {
-	int i=0,j=0;
+	int i=0;
 	*outFaultNum = 0;
-	int found = 0;
 	
-	TDBG("newfault num %d, To Date fault number %d\n ", newFaultNum, FaultNumToDate);
+	TDBG("newfault num %d, To Date fault number %d\n ", newFaultNum, index->count);
 	for ( i=0; i<newFaultNum; i++) {
-		found = 0;
-		for ( j=0; j<FaultNumToDate; j++) {
-			if (newFault[i].socket==faultToDate[j].socket
-					&& newFault[i].imc==faultToDate[j].imc
-					&& newFault[i].channel==faultToDate[j].channel
-					&& newFault[i].dimm==faultToDate[j].dimm
-					&& newFault[i].rank==faultToDate[j].rank
-					&& newFault[i].device==faultToDate[j].device
-					&& newFault[i].bank_group==faultToDate[j].bank_group
-					&& newFault[i].bank==faultToDate[j].bank
-					&& newFault[i].row==faultToDate[j].row) {
-				switch (fType) {
-				case ROWFAULT:
-					found = 1;
-					break;
-				case CELLFAULT:
-					if (newFault[i].col==faultToDate[j].col) {
-						found =1;
-					}
-					break;
-				default:
-					TCRIT("unrecognizable fault type\n");
-				}
-			}
-			
-			if (found) {
-				TWARN("Technically we should not find the same saved fault as the new fault\n");
-				break;
-			}
+		if (faultIndexHas(index, &newFault[i])) {
+			TWARN("Technically we should not find the same saved fault as the new fault\n");
 		}
-		if (!found && newFault[i].valid) {
+		else if (newFault[i].valid) {
 			memcpy((void *)(&outFault[*outFaultNum]), (void *)(&newFault[i]), sizeof(struct mfp_component));
 			*outFaultNum +=1;
 		}
@@ -960,18 +2747,9 @@ int isNewFaultRow(struct mfp_mem_fault_t *newfault, struct mfp_mem_fault_t *faul
  * Use 4KB aligned system address for comparison
  * if the system address is new, return 1. otherwise, return 0
  * ******************************************************************************/
-int isNewPageAddress(unsigned long long *offlinePageRecord, int size, unsigned long long sysAddr)
+int isNewPageAddress(struct mfp_page_set *pageSet, unsigned long long sysAddr)
 {
-	int i;
-	int retval = 1;
-
-	for (i=0; i<size; i++)  {
-		if ((*(offlinePageRecord+i) & ADDR_TRANS_MASK_4K) == (sysAddr & ADDR_TRANS_MASK_4K)) {
-			retval=0;
-			break;
-		}
-	}
-	return retval;
+	return !pageSetHas(pageSet, sysAddr);
 }
 
 /* Legacy API from MRT 2.1, not used in MRT 3 */
@@ -1004,7 +2782,7 @@ int updateRowFaultOnDimm(dimmFaultCount *rec, int recNum, struct mfp_mem_fault_t
 	return 0;
 }
 
-int getLastComponentFaultRec(FILE *pFile, struct mfp_component *pCompFault, int *faultCnt, struct mfp_dimm_entry *dimms, int dimmCnt, int *countByDimm, faultType fType)
+int getLastComponentFaultRec(FILE *pFile, struct mfp_fault_index *faultIndex, int *faultCnt, struct mfp_dimm_entry *dimms, int dimmCnt, int *countByDimm)
 {
 	int size = 0;
 	int i=0, j=0, k=0;
@@ -1013,8 +2791,9 @@ int getLastComponentFaultRec(FILE *pFile, struct mfp_component *pCompFault, int
 	size_t nmemb = 0;
 	size_t readNum = 0;
 	size_t maxInst = 0;
+	struct mfp_component *pCompFault = faultIndex->faults;
 	
-	switch (fType)
+	switch (faultIndex->fType)
 	{
 		case ROWFAULT:
 			maxInst = MAX_TOTAL_ROW_FAULT_NUM;
@@ -1054,7 +2833,8 @@ int getLastComponentFaultRec(FILE *pFile, struct mfp_component *pCompFault, int
 			if (rec[i].dimmInfo.loc.socket == dimms[j].loc.socket &&  rec[i].dimmInfo.loc.imc == dimms[j].loc.imc 
 					&& rec[i].dimmInfo.loc.channel == dimms[j].loc.channel && rec[i].dimmInfo.loc.dimm == dimms[j].loc.dimm
 					&& rec[i].dimmInfo.sn == dimms[j].sn && !memcmp(rec[i].dimmInfo.pn.s, dimms[j].pn.s, sizeof(dimms[j].pn.s))) {
-				memcpy(&pCompFault[k++], &rec[i].compFault,sizeof(rec[i].compFault));
+				memcpy(&pCompFault[k], &rec[i].compFault,sizeof(rec[i].compFault));
+				faultIndexAdd(faultIndex, k++);
 				if ( 0 == getIndexOfDimm(rec[i].dimmInfo.loc.socket, rec[i].dimmInfo.loc.imc, rec[i].dimmInfo.loc.channel, 
 						rec[i].dimmInfo.loc.dimm, &index) ) {
 					countByDimm[index] += 1;
@@ -1164,13 +2944,317 @@ int updateComponentFaultRec(FILE *pFile, struct mfp_component *compFault, struct
 }
 
 
-int pageOfflineFromFault(struct mfp_component compFault, faultType fType, unsigned long long *offLinePageAddr, int offLinePageStart, int *offLinePagesEnd)
+/*
+ * Row fault pages are those of every ROW_COL_STEP-th column. When the rank
+ * has a decode table, the table finds the columns where the row enters
+ * another 4KB page and only those are decoded by the library; a column the
+ * table keeps on the current page is skipped. A table result the library
+ * does not confirm drops the table and the row is walked again with the
+ * library only.
+ */
+#define ROW_COL_STEP	16
+
+static struct {
+	unsigned long	calls;			/* library decodes */
+	unsigned long	tableEvals;
+	unsigned long	skipped;		/* columns resolved by a table alone */
+	unsigned long	mismatched;
+} rowDecodeStat;
+
+/*
+ * Per-rank decode tables. With socket, imc, channel, dimm and rank fixed,
+ * the decode is modelled as affine over GF(2) in the bank group, bank, row
+ * and column bits: the system address is the address of DIMM address 0
+ * XOR the delta of every input bit that is set. The address decode library
+ * keeps its interleave parameters to itself, so buildDecodeTables() takes
+ * the deltas from library decodes for every rank of the inventory as soon
+ * as InitAddressDecodeLib() has run. A table is only kept when it decodes
+ * every pair of input bits and DECODE_VERIFY_SAMPLES random addresses the
+ * way the library does; ranks whose mapping is not affine (non power of
+ * two interleave, region boundaries inside the rank) keep using the
+ * library. The input packing takes each DIMM address mask as a run of low
+ * bits, so no table is built when one is not. Every address that is
+ * offlined is still confirmed by the library before the duplicate check,
+ * and a table that disagrees is dropped.
+ */
+#define DECODE_TABLE_ENTRIES	(MAX_DIMM_COUNT*2)
+#define DECODE_VERIFY_SAMPLES	64
+#define DECODE_COL_BITS			__builtin_popcount(COLUMN_MASK)
+#define DECODE_ROW_BITS			__builtin_popcount(ROW_MASK)
+#define DECODE_BANK_BITS		__builtin_popcount(BANK_MASK)
+#define DECODE_BG_BITS			__builtin_popcount(BG_MASK)
+#define DECODE_INPUT_BITS		(DECODE_COL_BITS + DECODE_ROW_BITS + DECODE_BANK_BITS + DECODE_BG_BITS)
+#define DECODE_MAX_INPUT_BITS	64
+#define DECODE_MASK_IS_LOW_RUN(m)	((((m) + 1ULL) & (m)) == 0)
+#define DECODE_AFFINE			0
+#define DECODE_LIBRARY			1
+
+#if defined (CONFIG_SPX_FEATURE_MFP_3)
+#define DECODE_RANK(pAddr)		((pAddr)->ChipSelect)
+#define DECODE_RANK_COUNT		(RANK_MASK + 1)
+#else
+#define DECODE_RANK(pAddr)		((pAddr)->PhysicalRankId)
+#define DECODE_RANK_COUNT		4
+#endif
+
+struct mfp_rank_decode {
+	int					state;
+	INT8U				socket;
+	INT8U				imc;
+	INT8U				channel;
+	INT8U				dimm;
+	INT8U				rank;
+	unsigned long long	validInputs;	/* input bits whose delta decoded */
+	unsigned long long	base;
+	unsigned long long	delta[DECODE_MAX_INPUT_BITS];
+};
+static struct mfp_rank_decode *rankDecode[DECODE_TABLE_ENTRIES];
+static int rankDecodeCount = 0;
+
+/* the DIMM address of a rank as pageOfflineFromFault() hands it to the library */
+static void initRankAddress(INT8U socket, INT8U imc, INT8U channel, INT8U dimm, INT8U rank, dimmBDFst *pDimmBdp, TRANSLATED_ADDRESS *pAddr)
+{
+	memset(pAddr, 0, sizeof(*pAddr));
+	pAddr->SocketId           = socket & SOCKET_MASK;
+	pAddr->MemoryControllerId = imc & IMC_MASK;
+	pAddr->ChannelId          = channel & IMC_BASE_CHANNEL_MASK;
+	pAddr->DimmSlot           = dimm & DIMM_MASK;
+#if defined (CONFIG_SPX_FEATURE_MFP_2)
+	pAddr->PhysicalRankId     = rank & 0x03;
+#elif defined (CONFIG_SPX_FEATURE_MFP_3)
+	pAddr->ChipSelect         = rank & RANK_MASK;
+	pAddr->PhysicalRankId     = 0xFF;
+#endif
+
+	pDimmBdp->cpuType  = (uint8_t) type[socket & SOCKET_MASK];
+	pDimmBdp->bus      = bus[socket & SOCKET_MASK];
+	pDimmBdp->socket   = socket & SOCKET_MASK;
+	pDimmBdp->imc      = imc & IMC_MASK;
+	pDimmBdp->channel  = channel & IMC_BASE_CHANNEL_MASK;
+}
+
+static unsigned long long packDecodeInput(const TRANSLATED_ADDRESS *pAddr)
+{
+	return (unsigned long long)(pAddr->Col & COLUMN_MASK)
+		| (unsigned long long)(pAddr->Row & ROW_MASK) << DECODE_COL_BITS
+		| (unsigned long long)(pAddr->Bank & BANK_MASK) << (DECODE_COL_BITS + DECODE_ROW_BITS)
+		| (unsigned long long)(pAddr->BankGroup & BG_MASK) << (DECODE_COL_BITS + DECODE_ROW_BITS + DECODE_BANK_BITS);
+}
+
+static void unpackDecodeInput(TRANSLATED_ADDRESS *pAddr, unsigned long long in)
+{
+	pAddr->Col = (UINT32)(in & COLUMN_MASK);
+	in >>= DECODE_COL_BITS;
+	pAddr->Row = (UINT32)(in & ROW_MASK);
+	in >>= DECODE_ROW_BITS;
+	pAddr->Bank = (INT8U)(in & BANK_MASK);
+	in >>= DECODE_BANK_BITS;
+	pAddr->BankGroup = (INT8U)(in & BG_MASK);
+}
+
+static unsigned long long evalRankDecode(const struct mfp_rank_decode *rd, unsigned long long in)
+{
+	unsigned long long addr = rd->base;
+
+	while (in) {
+		addr ^= rd->delta[__builtin_ctzll(in)];
+		in &= in - 1;
+	}
+	return addr;
+}
+
+/* decode input in through the library and compare it with the table */
+static int checkRankDecode(const struct mfp_rank_decode *rd, dimmBDFst *pDimmBdp, const TRANSLATED_ADDRESS *pAddr, unsigned long long in)
+{
+	TRANSLATED_ADDRESS probe;
+
+	memcpy(&probe, pAddr, sizeof(probe));
+	unpackDecodeInput(&probe, in);
+	if (DimmAddressToSystemAddress(pDimmBdp, &probe) || probe.SystemAddress != evalRankDecode(rd, in)) {
+		return -1;
+	}
+	return 0;
+}
+
+/* ***************************************************************
+ * Learn the table of one rank from the library and verify it
+ * return : 0 when the table is exact on every check, -1 otherwise
+ *****************************************************************/
+static int buildRankDecode(struct mfp_rank_decode *rd, dimmBDFst *pDimmBdp, const TRANSLATED_ADDRESS *pAddr)
+{
+	TRANSLATED_ADDRESS probe;
+	unsigned long long seed, in, pair;
+	int bit, i;
+
+	rd->validInputs = 0;
+	rd->state = DECODE_LIBRARY;
+	memcpy(&probe, pAddr, sizeof(probe));
+	unpackDecodeInput(&probe, 0);
+	if (DimmAddressToSystemAddress(pDimmBdp, &probe)) {
+		/* no such rank */
+		return -1;
+	}
+	rd->base = probe.SystemAddress;
+	for (bit=0; bit<DECODE_INPUT_BITS; bit++) {
+		memcpy(&probe, pAddr, sizeof(probe));
+		unpackDecodeInput(&probe, 1ULL << bit);
+		/* a bit beyond the DIMM geometry fails to decode and stays with the library */
+		if (DimmAddressToSystemAddress(pDimmBdp, &probe) == 0) {
+			rd->delta[bit] = probe.SystemAddress ^ rd->base;
+			rd->validInputs |= 1ULL << bit;
+		}
+	}
+
+	/* every pair of input bits, which catches carries between any two fields */
+	for (in=rd->validInputs; in; in &= in - 1) {
+		for (pair=in & (in - 1); pair; pair &= pair - 1) {
+			if (checkRankDecode(rd, pDimmBdp, pAddr, (in & -in) | (pair & -pair))) {
+				goto NOT_AFFINE;
+			}
+		}
+	}
+	seed = 0x9E3779B97F4A7C15ULL ^ ((unsigned long long)rd->socket << 32) ^ (rd->imc << 24) ^ (rd->channel << 16) ^ (rd->dimm << 8) ^ rd->rank;
+	for (i=0; i<DECODE_VERIFY_SAMPLES; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		if (checkRankDecode(rd, pDimmBdp, pAddr, seed & rd->validInputs)) {
+			goto NOT_AFFINE;
+		}
+	}
+	rd->state = DECODE_AFFINE;
+	TINFO("skt %d imc %d ch %d dimm %d rank %d: decode table built, %d of %d input bits\n",
+			rd->socket, rd->imc, rd->channel, rd->dimm, rd->rank, __builtin_popcountll(rd->validInputs), DECODE_INPUT_BITS);
+	return 0;
+
+NOT_AFFINE:
+	TINFO("skt %d imc %d ch %d dimm %d rank %d: decode is not affine, using address decode library\n",
+			rd->socket, rd->imc, rd->channel, rd->dimm, rd->rank);
+	return 0;
+}
+
+/* ***************************************************************
+ * Build the decode table of every rank of the DIMM inventory.
+ * Runs once, after InitAddressDecodeLib() and the inventory.
+ *****************************************************************/
+static void buildDecodeTables(void)
+{
+	struct mfp_rank_decode *rd = NULL;
+	dimmBDFst dimmBdp;
+	TRANSLATED_ADDRESS addr;
+	size_t i;
+	int rank, affine = 0;
+
+	if (DECODE_INPUT_BITS > DECODE_MAX_INPUT_BITS) {
+		return;
+	}
+	if (!DECODE_MASK_IS_LOW_RUN(COLUMN_MASK) || !DECODE_MASK_IS_LOW_RUN(ROW_MASK)
+			|| !DECODE_MASK_IS_LOW_RUN(BANK_MASK) || !DECODE_MASK_IS_LOW_RUN(BG_MASK)) {
+		TWARN("DIMM address masks are not low bit runs, using address decode library\n");
+		return;
+	}
+
+	for (i=0; i<dimmCount; i++) {
+		for (rank=0; rank<DECODE_RANK_COUNT; rank++) {
+			if (rankDecodeCount == DECODE_TABLE_ENTRIES) {
+				TWARN("decode tables full, remaining ranks use address decode library\n");
+				goto DONE;
+			}
+			if (rd == NULL && (rd = malloc(sizeof(*rd))) == NULL) {
+				TCRIT("Unable to Allocate Memory for decode tables\n");
+				goto DONE;
+			}
+			initRankAddress((INT8U)dimmArray[i].loc.socket, (INT8U)dimmArray[i].loc.imc, (INT8U)dimmArray[i].loc.channel,
+					(INT8U)dimmArray[i].loc.dimm, (INT8U)rank, &dimmBdp, &addr);
+			rd->socket = addr.SocketId;
+			rd->imc = addr.MemoryControllerId;
+			rd->channel = addr.ChannelId;
+			rd->dimm = addr.DimmSlot;
+			rd->rank = DECODE_RANK(&addr);
+			if (buildRankDecode(rd, &dimmBdp, &addr) == 0) {
+				affine += (rd->state == DECODE_AFFINE);
+				rankDecode[rankDecodeCount++] = rd;
+				rd = NULL;
+			}
+		}
+	}
+DONE:
+	free(rd);
+	TINFO("decode tables: %d ranks, %d affine\n", rankDecodeCount, affine);
+}
+
+/* table that decodes pAddr, or NULL when it has to go to the library */
+static struct mfp_rank_decode *getRankDecode(const TRANSLATED_ADDRESS *pAddr)
+{
+	struct mfp_rank_decode *rd;
+	int i;
+
+	for (i=0; i<rankDecodeCount; i++) {
+		rd = rankDecode[i];
+		if (rd->socket == pAddr->SocketId && rd->imc == pAddr->MemoryControllerId
+				&& rd->channel == pAddr->ChannelId && rd->dimm == pAddr->DimmSlot && rd->rank == DECODE_RANK(pAddr)) {
+			if (rd->state != DECODE_AFFINE || (packDecodeInput(pAddr) & ~rd->validInputs) != 0) {
+				return NULL;
+			}
+			return rd;
+		}
+	}
+	return NULL;
+}
+
+#ifdef DEBUG
+/* every page of the dense walk must be offlined after the stepped walk */
+static void verifyRowPages(dimmBDFst *pDimmBdp, TRANSLATED_ADDRESS *pAddr, UINT32 rowCols, struct mfp_page_set *pageSet)
+{
+	UINT32 col;
+
+	for (col=0; col<rowCols; col+=ROW_COL_STEP) {
+		pAddr->Col = col;
+		if (DimmAddressToSystemAddress(pDimmBdp, pAddr)) {
+			return;
+		}
+		if (!pageSetHas(pageSet, pAddr->SystemAddress)) {
+			TCRIT("row r %d col 0x%x: page 0x%llx missed by stepped walk\n", pAddr->Row, col,
+					pAddr->SystemAddress & ADDR_TRANS_MASK_4K);
+		}
+	}
+}
+#endif
+
+static int translateFaultAddress(dimmBDFst *pDimmBdp, TRANSLATED_ADDRESS *pAddr, UINT32 col)
+{
+	EFI_STATUS Status;
+
+	pAddr->Col = col;
+	rowDecodeStat.calls++;
+	Status = DimmAddressToSystemAddress(pDimmBdp, pAddr);
+	if (Status) {
+		TCRIT("[col 0x%x]: DimmAddressToSystemAddress() Error: 0x%llx\n", pAddr->Col, Status);
+		TCRIT("skt %d imc %d ch %d dimm %d rank %d, bg %d b %d r %d\n",
+		pAddr->SocketId,
+		pAddr->MemoryControllerId,
+		pAddr->ChannelId,
+		pAddr->DimmSlot,
+		pAddr->PhysicalRankId,
+		pAddr->BankGroup,
+		pAddr->Bank,
+		pAddr->Row);
+		return -1;
+	}
+	TDBG("[col 0x%x]: DimmAddressToSystemAddress(): address 0x%llx\n", pAddr->Col, pAddr->SystemAddress);
+	return 0;
+}
+
+int pageOfflineFromFault(struct mfp_component compFault, faultType fType, unsigned long long *offLinePageAddr, struct mfp_page_set *pageSet, int offLinePageStart, int *offLinePagesEnd)
 {
 	dimmBDFst dimmBdp;
 	TRANSLATED_ADDRESS  TranslatedAddress = {0};
-	EFI_STATUS          Status;
 	int pageCnt = 0;
 	int translationErr = 0;
+	struct mfp_rank_decode *rd;
+	UINT32 col;
+	UINT32 rowCols = (UINT32)(1<<DDR5ColWidth);
+	unsigned long long tableAddr = 0, pageAddr = 0;
 	
 	TranslatedAddress.SocketId           = compFault.socket & SOCKET_MASK;
 	TranslatedAddress.MemoryControllerId = compFault.imc & IMC_MASK;
@@ -1198,29 +3282,42 @@ int pageOfflineFromFault(struct mfp_component compFault, faultType fType, unsign
 	switch (fType)
 	{
 		case ROWFAULT:
-			
-			for (TranslatedAddress.Col=0; TranslatedAddress.Col<(UINT32)(1<<DDR5ColWidth); TranslatedAddress.Col+=16) {
-				Status = DimmAddressToSystemAddress(&dimmBdp, &TranslatedAddress);
-				if (Status) {
-					TCRIT("[col 0x%x]: DimmAddressToSystemAddress() Error: 0x%llx\n", TranslatedAddress.Col, Status);
-					TCRIT("skt %d imc %d ch %d dimm %d rank %d, bg %d b %d r %d\n",
-					TranslatedAddress.SocketId,
-					TranslatedAddress.MemoryControllerId,
-					TranslatedAddress.ChannelId,
-					TranslatedAddress.DimmSlot,
-					TranslatedAddress.PhysicalRankId,
-					TranslatedAddress.BankGroup,
-					TranslatedAddress.Bank,
-					TranslatedAddress.Row);
+			TranslatedAddress.Col = rowCols - 1;
+			rd = getRankDecode(&TranslatedAddress);
+ROW_WALK:
+			for (col=0; col<rowCols; col+=ROW_COL_STEP) {
+				if (rd != NULL) {
+					TranslatedAddress.Col = col;
+					tableAddr = evalRankDecode(rd, packDecodeInput(&TranslatedAddress));
+					rowDecodeStat.tableEvals++;
+					if (col > 0 && ((tableAddr ^ pageAddr) & ADDR_TRANS_MASK_4K) == 0) {
+						rowDecodeStat.skipped++;
+						continue;
+					}
+				}
+				if (translateFaultAddress(&dimmBdp, &TranslatedAddress, col)) {
 					translationErr = 1;
 					break ;
-				} else {
-					TDBG("[col 0x%x]: DimmAddressToSystemAddress(): address 0x%llx\n", TranslatedAddress.Col, TranslatedAddress.SystemAddress);
 				}
-				if (isNewPageAddress(offLinePageAddr, *offLinePagesEnd, TranslatedAddress.SystemAddress)) {
+				if (rd != NULL && TranslatedAddress.SystemAddress != tableAddr) {
+					TCRIT("[col 0x%x]: decode table mismatch: 0x%llx, library 0x%llx, dropping table\n",
+							col, tableAddr, TranslatedAddress.SystemAddress);
+					rowDecodeStat.mismatched++;
+					rd->state = DECODE_LIBRARY;
+					rd = NULL;
+					/* pages found so far trusted the table: redo the row with the library */
+					*offLinePagesEnd -= pageCnt;
+					while (pageCnt > 0) {
+						pageSetRemove(pageSet, offLinePageAddr[offLinePageStart + --pageCnt]);
+					}
+					goto ROW_WALK;
+				}
+				pageAddr = TranslatedAddress.SystemAddress;
+				if (isNewPageAddress(pageSet, pageAddr)) {
 					if (*offLinePagesEnd < MAX_TOTAL_ROW_FAULT_PAGE_NUM) {
-						offLinePageAddr[offLinePageStart+pageCnt] = TranslatedAddress.SystemAddress & ADDR_TRANS_MASK_4K;
-						TINFO("[col 0x%x]: translated page address 0x%llx\n", TranslatedAddress.Col, offLinePageAddr[offLinePageStart+pageCnt]);					
+						offLinePageAddr[offLinePageStart+pageCnt] = pageAddr & ADDR_TRANS_MASK_4K;
+						pageSetAdd(pageSet, pageAddr);
+						TINFO("[col 0x%x]: translated page address 0x%llx\n", col, offLinePageAddr[offLinePageStart+pageCnt]);					
 						*offLinePagesEnd += 1;
 						pageCnt++;
 					}
@@ -1231,28 +3328,26 @@ int pageOfflineFromFault(struct mfp_component compFault, faultType fType, unsign
 			}
 			if (translationErr) {
 				*offLinePagesEnd -= pageCnt;	//rewind
+				while (pageCnt > 0) {
+					pageSetRemove(pageSet, offLinePageAddr[offLinePageStart + --pageCnt]);
+				}
+			}
+#ifdef DEBUG
+			else if (*offLinePagesEnd < MAX_TOTAL_ROW_FAULT_PAGE_NUM) {
+				verifyRowPages(&dimmBdp, &TranslatedAddress, rowCols, pageSet);
 			}
+#endif
 			break;
 		case CELLFAULT:
-			Status = DimmAddressToSystemAddress(&dimmBdp, &TranslatedAddress);
-			if (Status) {
-				TCRIT("[col 0x%x]: DimmAddressToSystemAddress() Error: 0x%llx\n", TranslatedAddress.Col, Status);
-				TCRIT("skt %d imc %d ch %d dimm %d rank %d, bg %d b %d r %d\n",
-				TranslatedAddress.SocketId,
-				TranslatedAddress.MemoryControllerId,
-				TranslatedAddress.ChannelId,
-				TranslatedAddress.DimmSlot,
-				TranslatedAddress.PhysicalRankId,
-				TranslatedAddress.BankGroup,
-				TranslatedAddress.Bank,
-				TranslatedAddress.Row);
+			if (translateFaultAddress(&dimmBdp, &TranslatedAddress, TranslatedAddress.Col)) {
 				translationErr = 1;
 				break ;
 			} else {
-				if (isNewPageAddress(offLinePageAddr, *offLinePagesEnd, TranslatedAddress.SystemAddress)) {
+				if (isNewPageAddress(pageSet, TranslatedAddress.SystemAddress)) {
 					if (*offLinePagesEnd < MAX_TOTAL_CELL_FAULT_PAGE_NUM) {
 						TINFO("[col 0x%x]: translated page address 0x%llx\n", TranslatedAddress.Col, TranslatedAddress.SystemAddress);
 						offLinePageAddr[offLinePageStart] = TranslatedAddress.SystemAddress;
+						pageSetAdd(pageSet, TranslatedAddress.SystemAddress);
 						*offLinePagesEnd +=1;
 					}
 				}
@@ -1261,31 +3356,256 @@ int pageOfflineFromFault(struct mfp_component compFault, faultType fType, unsign
 		default:
 			TCRIT("unsupported fault type\n");
 	}
-	
-	return translationErr? -1 : 0;
+	
+	return translationErr? -1 : 0;
+}
+
+/* queue pSysAddr[*start..end) for the next deliverOffLinePages() */
+int queueOffLinePages(unsigned long long *pSysAddr, int *start, int *end)
+{
+	int i;
+
+	if ( *end < *start ) {
+		TCRIT("end = %d < start %d, Should not happen, Error\n", *end, *start);
+		return -1;
+	}
+	if ( *end == *start ) {
+		return 0;
+	}
+	for (i=0; i<faultDeliveryNum; i++) {
+		/* pages still waiting from an earlier delivery of the same array */
+		if (faultDelivery[i].pSysAddr == pSysAddr) {
+			faultDelivery[i].end = *end;
+			return 0;
+		}
+	}
+	if (faultDeliveryNum >= FAULT_DELIVERY_RANGES) {
+		TCRIT("too many offline page ranges queued\n");
+		return -1;
+	}
+	faultDelivery[faultDeliveryNum].pSysAddr = pSysAddr;
+	faultDelivery[faultDeliveryNum].start = start;
+	faultDelivery[faultDeliveryNum].end = *end;
+	faultDeliveryNum++;
+	return 0;
+}
+
+/* take up to max queued addresses of one range */
+static int takeRangePages(struct mfp_fault_range *range, unsigned long long *buf, int max)
+{
+	int cnt = range->end - *range->start;
+
+	if (cnt > max) {
+		cnt = max;
+	}
+	memcpy(buf, &range->pSysAddr[*range->start], cnt * sizeof(unsigned long long));
+	*range->start += cnt;
+	return cnt;
+}
+
+/* take up to max queued addresses, row pages first */
+static int takeOffLinePages(unsigned long long *buf, int max)
+{
+	int i, num = 0;
+
+	for (i=0; i<faultDeliveryNum && num<max; i++) {
+		num += takeRangePages(&faultDelivery[i], &buf[num], max - num);
+	}
+	return num;
+}
+
+/* the consumer signals support for frames by creating the ack FIFO */
+static int openFaultAck(void)
+{
+	INT32U seq[16];
+
+	if (fdFaultAck >= 0) {
+		return 0;
+	}
+	if (access(MFPFAULTACKQUEUE, F_OK) != 0) {
+		return -1;
+	}
+	/* holding a write end too keeps a closing consumer from signalling EOF */
+	fdFaultAck = sigwrap_open(MFPFAULTACKQUEUE, O_RDWR | O_NONBLOCK);
+	if (fdFaultAck < 0) {
+		TCRIT("Error opening named pipe %s\n", MFPFAULTACKQUEUE);
+		return -1;
+	}
+	/* acknowledgements left from an earlier run do not count */
+	while (read(fdFaultAck, seq, sizeof(seq)) > 0) {
+	}
+	TINFO("%s found, sending sequenced fault frames\n", MFPFAULTACKQUEUE);
+	return 0;
+}
+
+/* wait until seq is acknowledged, return 0 or -1 on timeout */
+static int waitFaultAck(INT32U seq, unsigned long long timeoutMs)
+{
+	unsigned long long startMs = getMonoMs(), nowMs = startMs;
+	struct timeval tv;
+	fd_set rfds;
+	INT32U ack[16];
+	int len, i;
+
+	while ((INT32)(faultAckedSeq - seq) < 0) {
+		if (nowMs - startMs >= timeoutMs) {
+			return -1;
+		}
+		FD_ZERO(&rfds);
+		FD_SET(fdFaultAck, &rfds);
+		tv.tv_sec = (timeoutMs - (nowMs - startMs)) / 1000;
+		tv.tv_usec = ((timeoutMs - (nowMs - startMs)) % 1000) * 1000;
+		if (select(fdFaultAck + 1, &rfds, NULL, NULL, &tv) > 0) {
+			len = read(fdFaultAck, ack, sizeof(ack));
+			for (i=0; i<len/(int)sizeof(INT32U); i++) {
+				if ((INT32)(ack[i] - faultAckedSeq) > 0) {
+					faultAckedSeq = ack[i];
+				}
+			}
+		}
+		nowMs = getMonoMs();
+	}
+	nowMs -= startMs;
+	faultAckAvgMs = (faultAckAvgMs * 7 + nowMs) / 8;
+	if (nowMs > faultStat.maxAckMs) {
+		faultStat.maxAckMs = nowMs;
+	}
+	return 0;
+}
+
+/* frames that fit in the fault FIFO at once */
+static int faultFrameWindow(void)
+{
+	long capacity = PIPE_BUF;
+	int window;
+
+#ifdef F_GETPIPE_SZ
+	long size = fcntl(fdFaultFifo, F_GETPIPE_SZ);
+	if (size > capacity) {
+		capacity = size;
+	}
+#endif
+	window = capacity / FAULT_FRAME_MAX_BYTES;
+	if (window > FAULT_FRAME_WINDOW) {
+		window = FAULT_FRAME_WINDOW;
+	}
+	return window > 0 ? window : 1;
+}
+
+/* raise the SCI until frame seq is acknowledged; -1 if the consumer does not answer */
+static int signalFaultFrames(INT32U seq, int frames)
+{
+	unsigned long long timeoutMs;
+
+	TDBG("Trigger the SCI pin to notify BIOS of %d memory fault frames\n", frames);
+	triggerSci();
+	faultStat.scis++;
+	timeoutMs = faultAckAvgMs * 4;
+	if (timeoutMs < FAULT_ACK_MIN_MS) {
+		timeoutMs = FAULT_ACK_MIN_MS;
+	}
+	if (timeoutMs > FAULT_ACK_MAX_MS) {
+		timeoutMs = FAULT_ACK_MAX_MS;
+	}
+	if (waitFaultAck(seq, timeoutMs) != 0) {
+		/* SCI may have been missed, raise it once more and allow the full wait */
+		faultStat.timeouts++;
+		triggerSci();
+		faultStat.scis++;
+		if (waitFaultAck(seq, FAULT_ACK_MAX_MS) != 0) {
+			faultStat.timeouts++;
+			TCRIT("fault frame %u not acknowledged in %u ms\n", seq, FAULT_ACK_MAX_MS);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* return 0 when every queued page was acknowledged, 1 when some stay queued */
+static int deliverFaultFrames(void)
+{
+	struct {
+		struct mfp_fault_frame	hdr;
+		unsigned long long		addr[MAX_FAULT_ERR];
+	} frame;
+	int frames, writeByte, window;
+
+	/* frames of an unacknowledged window may still fill the FIFO */
+	if (faultAckedSeq != faultSeq && signalFaultFrames(faultSeq, 0) != 0) {
+		return 1;
+	}
+	window = faultFrameWindow();
+	while (1) {
+		for (frames=0; frames<window; frames++) {
+			frame.hdr.count = takeOffLinePages(frame.addr, MAX_FAULT_ERR);
+			if (frame.hdr.count == 0) {
+				break;
+			}
+			frame.hdr.magic = FAULT_FRAME_MAGIC;
+			frame.hdr.seq = ++faultSeq;
+			frame.hdr.reserved = 0;
+			writeByte = sizeof(frame.hdr) + frame.hdr.count * sizeof(unsigned long long);
+			if (writeByte != sigwrap_write(fdFaultFifo, (void *)&frame, writeByte)) {
+				TCRIT("writing mfp fault pipe gets error %d\n", errno);
+				return -1;
+			}
+			faultStat.frames++;
+		}
+		if (frames == 0) {
+			return 0;
+		}
+		if (signalFaultFrames(faultSeq, frames) != 0) {
+			return 1;
+		}
+	}
+}
+
+/* wait until the consumer has read the fault FIFO empty, at most FAULT_LEGACY_SCI_WAIT */
+static void waitFaultFifoDrained(void)
+{
+	unsigned long long startMs = getMonoMs(), waitedMs;
+	struct timespec ts;
+	int unread;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = FAULT_DRAIN_POLL_MS * 1000000L;
+	while (1) {
+		if (ioctl(fdFaultFifo, FIONREAD, &unread) != 0) {
+			/* fill level unknown, give host and bios the whole time to handle the SCI */
+			sleep(FAULT_LEGACY_SCI_WAIT);
+			return;
+		}
+		waitedMs = getMonoMs() - startMs;
+		if (unread == 0) {
+			faultAckAvgMs = (faultAckAvgMs * 7 + waitedMs) / 8;
+			if (waitedMs > faultStat.maxAckMs) {
+				faultStat.maxAckMs = waitedMs;
+			}
+			return;
+		}
+		if (waitedMs >= FAULT_LEGACY_SCI_WAIT * 1000ULL) {
+			faultStat.timeouts++;
+			TWARN("fault consumer left %d bytes unread in %d s\n", unread, FAULT_LEGACY_SCI_WAIT);
+			return;
+		}
+		nanosleep(&ts, NULL);
+	}
 }
 
-int writeOffLinePages(unsigned long long *pSysAddr, int *start, int *end)
+static int deliverLegacyFaults(void)
 {
-	int pageCnt = 0;
+	unsigned long long addr[MAX_FAULT_ERR];
 	int tx_count = 0;
 	int writtenByte = 0, writeByte;
-	
-	
-	if (*end > *start) {
-		pageCnt = *end - *start;
-	}
-	else if ( *end < *start ) {
-		TCRIT("end = %d < start %d, Should not happen, Error\n", *end, *start);
-		return -1;
-	}
-	else {
-		return 0;
-	}
-	
-	while ( pageCnt > 0) {
+	int i = 0;
 
-   	    tx_count = pageCnt >= MAX_FAULT_ERR? MAX_FAULT_ERR : pageCnt;
+	/* the legacy consumer gets row and cell pages in separate chunks */
+	while ( i < faultDeliveryNum ) {
+		tx_count = takeRangePages(&faultDelivery[i], addr, MAX_FAULT_ERR);
+		if (tx_count == 0) {
+			i++;
+			continue;
+		}
 		/*
 		 * Transmit the page count followed by page addresses
 		 */
@@ -1294,7 +3614,7 @@ int writeOffLinePages(unsigned long long *pSysAddr, int *start, int *end)
 		writtenByte = sigwrap_write(fdFaultFifo, (void *)&tx_count, sizeof(tx_count));
 		/* Tx 2: records */
 		writeByte   = tx_count * sizeof(unsigned long long);
-		writtenByte = sigwrap_write(fdFaultFifo, (void *)&pSysAddr[*start], writeByte);
+		writtenByte = sigwrap_write(fdFaultFifo, (void *)addr, writeByte);
 		if (writeByte == writtenByte) {
 			TINFO("mfp fault data was written: %d records\n", tx_count);
 			/*
@@ -1302,7 +3622,8 @@ int writeOffLinePages(unsigned long long *pSysAddr, int *start, int *end)
 			 */
 			TDBG("Trigger the SCI pin to notify BIOS of memory fault\n");
 			triggerSci();
-			sleep(2);	//Give host and bios 2 second to handle SCI
+			faultStat.scis++;
+			waitFaultFifoDrained();	//Give host and bios time to handle SCI
 		} else {
 			if (writtenByte == 0) {
 				TCRIT("no mfp fault data is written\n");
@@ -1312,13 +3633,49 @@ int writeOffLinePages(unsigned long long *pSysAddr, int *start, int *end)
 			}
 			TCRIT("Not get right size of data\n");
 		}
-		pageCnt -= tx_count;
-		*start  += tx_count;
 	}
-
 	return 0;
 }
 
+/* hand every queued page to BIOS */
+int deliverOffLinePages(void)
+{
+	unsigned long long startMs = getMonoMs();
+	int i, pageCnt = 0, retVal;
+
+	for (i=0; i<faultDeliveryNum; i++) {
+		pageCnt += faultDelivery[i].end - *faultDelivery[i].start;
+	}
+	if (pageCnt == 0) {
+		faultDeliveryNum = 0;
+		return 0;
+	}
+
+	if (openFaultAck() == 0) {
+		retVal = deliverFaultFrames();
+		if (retVal == 1) {
+			for (i=0, pageCnt=0; i<faultDeliveryNum; i++) {
+				pageCnt += faultDelivery[i].end - *faultDelivery[i].start;
+			}
+			TWARN("fault consumer is not acknowledging, %d offline pages stay queued\n", pageCnt);
+			return retVal;
+		}
+	}
+	else {
+		retVal = deliverLegacyFaults();
+	}
+	/* pages a failed write left behind are not retried, as before */
+	for (i=0; i<faultDeliveryNum; i++) {
+		*faultDelivery[i].start = faultDelivery[i].end;
+	}
+	faultDeliveryNum = 0;
+
+	TINFO("%d offline pages delivered in %llu ms: %lu SCIs, %lu frames, %lu ack timeouts, ack avg %llu ms max %llu ms\n",
+			pageCnt, getMonoMs() - startMs, faultStat.scis, faultStat.frames, faultStat.timeouts,
+			faultAckAvgMs, faultStat.maxAckMs);
+	return retVal;
+}
+
 int isCapReached(struct mfp_component *compf, int *faultByDimm, faultType fType)
 {
 	INT32U index = 0;
@@ -1341,10 +3698,34 @@ int isCapReached(struct mfp_component *compf, int *faultByDimm, faultType fType)
 	return retVal;
 }
 
+/* ***************************************************************
+ * Wait until the host reports POST complete. It may have been reset
+ * since the inventory was read, and the replayed pages are delivered
+ * to it. HOST_BOOTING_KEY is read every HOST_READY_POLL_TIME seconds
+ * with a warning every HOST_READY_WARN_TIME seconds.
+ *****************************************************************/
+static void waitHostReady(void)
+{
+	char status[REDIS_LENGTH];
+	int waitTime = 0;
+
+	while (1) {
+		status[0] = '\0';
+		if (redisMgrGetString(HOST_BOOTING_KEY, status, sizeof(status)) == 0 && strcmp(status, "false") == 0) {
+			return;
+		}
+		if (waitTime && waitTime % HOST_READY_WARN_TIME == 0) {
+			TWARN("host has not completed POST in %d s (%s %s), fault replay waits\n",
+					waitTime, HOST_BOOTING_KEY, status[0] ? status : "unset");
+		}
+		sleep(HOST_READY_POLL_TIME);
+		waitTime += HOST_READY_POLL_TIME;
+	}
+}
+
 void *colMemFaultThread(void *pArg)
 {
 	sigset_t   mask;
-	int cpu_wait = 0;
 
 	int i;
 	int rowOffLinedPageStart = 0;
@@ -1383,39 +3764,32 @@ void *colMemFaultThread(void *pArg)
 	sigprocmask(SIG_SETMASK, &mask, NULL);
 	prctl(PR_SET_NAME,__FUNCTION__,0,0,0);
 
-	/*
-	 * It is possible that this thread starts running
-	 * before DetectCpuType() is called
-	 */
-	sleep(180);        //Wait until host OS has started up, 3 minutes should be long enough
-	printf("Thread %s starts\n", __FUNCTION__);
-	while(nrCPU == 0) {
-		cpu_wait += 2;
-		sleep(2);
-		if(cpu_wait > CPU_DETECT_INTERVAL)
-			TCRIT("ERROR: The number of CPU = 0 after %ds.\n", cpu_wait);
-		else
-			TINFO("mfp: The number of CPU = 0. Wait for %ds.\n", cpu_wait);
+	/* the replay needs the CPUs, address decode and an initialized engine */
+	if (waitStages(STAGE_BIT(STAGE_ADDR_DECODE) | STAGE_BIT(STAGE_ENGINE)) != 0) {
+		TCRIT("Thread %s does not start, startup failed\n", __FUNCTION__);
+		endStage(STAGE_HOST_READY, 0);
+		endStage(STAGE_FAULT_REPLAY, 0);
+		return NULL;
 	}
-    TDBG("mfp: The number of CPU = %d\n", nrCPU);
-    
-	/* Initialization of ADDRESS_TRANSLATION */
-	
-#if defined (CONFIG_SPX_FEATURE_MFP_2)
-	EFI_STATUS eresult = InitAddressDecodeLib(nrCPU);
-#elif defined (CONFIG_SPX_FEATURE_MFP_3)
-	EFI_STATUS eresult = InitAddressDecodeLib(bus, nrCPU);
+	/* and a host that is up to take the replayed pages */
+	beginStage(STAGE_HOST_READY);
+#if !defined(EVB_DEBUG)
+	waitHostReady();
 #endif
-	if( EFI_SUCCESS !=  eresult) {
-		TCRIT("InitAddressDecodeLib() fails: 0x%llx\n", eresult);
-	}
+	endStage(STAGE_HOST_READY, 1);
+	beginStage(STAGE_FAULT_REPLAY);
+	printf("Thread %s starts\n", __FUNCTION__);
+    TDBG("mfp: The number of CPU = %d\n", nrCPU);
 
-	getLastComponentFaultRec(pRowFaultRec, rowFault, &row_fault_count, dimmArray, dimmCount, rowFaultByDimm, ROWFAULT);
+	faultIndexInit(&rowFaultIndex, rowFault, ROWFAULT);
+	getLastComponentFaultRec(pRowFaultRec, &rowFaultIndex, &row_fault_count, dimmArray, dimmCount, rowFaultByDimm);
 	for ( i=0; i<row_fault_count;i++ ) {
 		rowOffLinedPageCurStart = rowOffLinedPageEnd;
-		pageOfflineFromFault(rowFault[i], ROWFAULT, rowOffLinedPagesSysAddr, rowOffLinedPageCurStart, &rowOffLinedPageEnd);
+		pageOfflineFromFault(rowFault[i], ROWFAULT, rowOffLinedPagesSysAddr, &rowPageSet, rowOffLinedPageCurStart, &rowOffLinedPageEnd);
 	}	
-	writeOffLinePages(rowOffLinedPagesSysAddr, &rowOffLinedPageStart, &rowOffLinedPageEnd);
+	queueOffLinePages(rowOffLinedPagesSysAddr, &rowOffLinedPageStart, &rowOffLinedPageEnd);
+	TINFO("row fault replay: %lu library decodes, %lu table decodes, %lu columns skipped, %lu table mismatches\n",
+			rowDecodeStat.calls, rowDecodeStat.tableEvals, rowDecodeStat.skipped, rowDecodeStat.mismatched);
 	fclose(pRowFaultRec);
 	
 	writeComponentFaultRec(MRT_ROW_FAULT_REC, rowFault, row_fault_count, dimmArray, dimmCount);
@@ -1426,12 +3800,14 @@ void *colMemFaultThread(void *pArg)
 		return NULL;
 	}
 	
-	getLastComponentFaultRec(pCellFaultRec, cellFault, &cell_fault_count, dimmArray, dimmCount, cellFaultByDimm, CELLFAULT);
+	faultIndexInit(&cellFaultIndex, cellFault, CELLFAULT);
+	getLastComponentFaultRec(pCellFaultRec, &cellFaultIndex, &cell_fault_count, dimmArray, dimmCount, cellFaultByDimm);
 	for ( i=0; i<cell_fault_count;i++ ) {
 		cellOffLinedPageCurStart = cellOffLinedPageEnd;
-		pageOfflineFromFault(cellFault[i], CELLFAULT, cellOffLinedPagesSysAddr, cellOffLinedPageCurStart, &cellOffLinedPageEnd);
+		pageOfflineFromFault(cellFault[i], CELLFAULT, cellOffLinedPagesSysAddr, &cellPageSet, cellOffLinedPageCurStart, &cellOffLinedPageEnd);
 	}
-	writeOffLinePages(cellOffLinedPagesSysAddr, &cellOffLinedPageStart, &cellOffLinedPageEnd);
+	queueOffLinePages(cellOffLinedPagesSysAddr, &cellOffLinedPageStart, &cellOffLinedPageEnd);
+	deliverOffLinePages();
 	fclose(pCellFaultRec);
 	
 	writeComponentFaultRec(MRT_CELL_FAULT_REC, cellFault, cell_fault_count, dimmArray, dimmCount);
@@ -1446,6 +3822,8 @@ void *colMemFaultThread(void *pArg)
     	mfp_stat(dimmArray[i].loc, &statResult);
     	updateStatResult(dimmArray[i].loc, &statResult);
     }
+    flushStatResult(1);
+    endStage(STAGE_FAULT_REPLAY, 1);
 	
     mfp_recent_faults(&recentFaults);
     memcpy(&rowAnchor, &recentFaults.rows[0],sizeof(rowAnchor));
@@ -1470,9 +3848,9 @@ void *colMemFaultThread(void *pArg)
 				getNewFaultsFromRecent(&rowAnchor, rowFaultFromRecent, &rowFaultNumFromRecent, recentFaults.rows);
 				memcpy(&rowAnchor, &recentFaults.rows[0], sizeof(rowAnchor));
 				if (rowFaultNumFromRecent) {
-					filterNewFaultByExistFault(rowFault, row_fault_count, 
+					filterNewFaultByExistFault(&rowFaultIndex,
 						rowFaultFilterByRec, &rowFaultNumFilterByRec,
-						rowFaultFromRecent, rowFaultNumFromRecent, ROWFAULT);
+						rowFaultFromRecent, rowFaultNumFromRecent);
 				}
 				else {
 					rowFaultNumFilterByRec = 0;
@@ -1480,15 +3858,15 @@ void *colMemFaultThread(void *pArg)
 				
 				TINFO("rowFaultNumFilterByRec is %d\n", rowFaultNumFilterByRec);
 
-				rowOffLinedPageStart = rowOffLinedPageEnd;
 				for ( i=0; i<rowFaultNumFilterByRec; i++ ) {
 					// reach cap per dimm?
 					if ( !isCapReached(&rowFaultFilterByRec[i], rowFaultByDimm, ROWFAULT) ) {
 						//addr trans
 						rowOffLinedPageCurStart = rowOffLinedPageEnd;
-						if ( !pageOfflineFromFault(rowFaultFilterByRec[i], ROWFAULT, rowOffLinedPagesSysAddr, rowOffLinedPageCurStart, &rowOffLinedPageEnd) ) {
+						if ( !pageOfflineFromFault(rowFaultFilterByRec[i], ROWFAULT, rowOffLinedPagesSysAddr, &rowPageSet, rowOffLinedPageCurStart, &rowOffLinedPageEnd) ) {
 							if ( row_fault_count < MAX_TOTAL_ROW_FAULT_NUM) {
-								memcpy(&rowFault[row_fault_count++], &rowFaultFilterByRec[i], sizeof(rowFaultFilterByRec[i]));
+								memcpy(&rowFault[row_fault_count], &rowFaultFilterByRec[i], sizeof(rowFaultFilterByRec[i]));
+								faultIndexAdd(&rowFaultIndex, row_fault_count++);
 								updateComponentFaultRec(pRowFaultRec, &rowFaultFilterByRec[i], dimmArray, dimmCount, ROWFAULT);
 
 								//udpate rowFaultByDimm
@@ -1502,7 +3880,7 @@ void *colMemFaultThread(void *pArg)
 					}
 				}
 				//page offline
-				writeOffLinePages(rowOffLinedPagesSysAddr, &rowOffLinedPageStart, &rowOffLinedPageEnd);
+				queueOffLinePages(rowOffLinedPagesSysAddr, &rowOffLinedPageStart, &rowOffLinedPageEnd);
 			}
 			else {
 				TINFO("page offlining number for row fault %d, reach max, no more offlining\n", rowOffLinedPageEnd);
@@ -1512,9 +3890,9 @@ void *colMemFaultThread(void *pArg)
 				getNewFaultsFromRecent(&cellAnchor, cellFaultFromRecent, &cellFaultNumFromRecent, recentFaults.cells);
 				memcpy(&cellAnchor, &recentFaults.cells[0], sizeof(cellAnchor));
 				if (cellFaultNumFromRecent) {
-					filterNewFaultByExistFault(cellFault, cell_fault_count, 
+					filterNewFaultByExistFault(&cellFaultIndex,
 						cellFaultFilterByRec, &cellFaultNumFilterByRec,
-						cellFaultFromRecent, cellFaultNumFromRecent, CELLFAULT);
+						cellFaultFromRecent, cellFaultNumFromRecent);
 				}
 				else {
 					cellFaultNumFilterByRec = 0;
@@ -1522,14 +3900,14 @@ void *colMemFaultThread(void *pArg)
 				
 				TINFO("cellFaultNumFilterByRec is %d\n", cellFaultNumFilterByRec);
 				// reach cap per dimm?
-				cellOffLinedPageStart = cellOffLinedPageEnd;
 				for ( i=0; i<cellFaultNumFilterByRec; i++ ) {
 					if ( !isCapReached(&cellFaultFilterByRec[i], cellFaultByDimm, CELLFAULT) ) {
 						//addr trans
 						cellOffLinedPageCurStart = cellOffLinedPageEnd;
-						if ( !pageOfflineFromFault(cellFaultFilterByRec[i], CELLFAULT, cellOffLinedPagesSysAddr, cellOffLinedPageCurStart, &cellOffLinedPageEnd) ) {
+						if ( !pageOfflineFromFault(cellFaultFilterByRec[i], CELLFAULT, cellOffLinedPagesSysAddr, &cellPageSet, cellOffLinedPageCurStart, &cellOffLinedPageEnd) ) {
 							if ( cell_fault_count < MAX_TOTAL_CELL_FAULT_NUM) {
-								memcpy(&cellFault[cell_fault_count++], &cellFaultFilterByRec[i], sizeof(cellFaultFilterByRec[i]));
+								memcpy(&cellFault[cell_fault_count], &cellFaultFilterByRec[i], sizeof(cellFaultFilterByRec[i]));
+								faultIndexAdd(&cellFaultIndex, cell_fault_count++);
 								updateComponentFaultRec(pCellFaultRec, &cellFaultFilterByRec[i], dimmArray, dimmCount, CELLFAULT);
 
 								//udpate cellFaultByDimm
@@ -1543,11 +3921,13 @@ void *colMemFaultThread(void *pArg)
 					}
 				}
 				//page offline
-				writeOffLinePages(cellOffLinedPagesSysAddr, &cellOffLinedPageStart, &cellOffLinedPageEnd);
+				queueOffLinePages(cellOffLinedPagesSysAddr, &cellOffLinedPageStart, &cellOffLinedPageEnd);
 			}
 			else {
 				TINFO("page offlining number for cell fault %d, reach max, no more offlining\n", cellOffLinedPageEnd);
 			}
+			deliverOffLinePages();
+			flushStatResult(0);
 			
 #ifdef DEBUG
 			printStatResult();
@@ -1555,6 +3935,8 @@ void *colMemFaultThread(void *pArg)
 		}
 		else {
 //			TDBG("No memory errors, sleep for %u seconds \n", DATA_MEMORY_FAULT_COLLECT_SLEEP);
+			deliverOffLinePages();
+			flushStatResult(0);
 			sleep(DATA_MEMORY_FAULT_COLLECT_SLEEP);
 		}
 	}
@@ -1564,194 +3946,170 @@ void *colMemFaultThread(void *pArg)
 
 int setDimm()
 {
-    redisContext *c = NULL;
     redisReply *reply;
     
-    c = redisConnectUnix(REDIS_SOCK);
-    if (c->err)
+    if (redisMgrAcquire() != 0)
     {
     	TCRIT("redis connect unix fails\n");
-        redisFree(c);
         return -1;
     }
-    reply = redisCommand(c,"SET Redfish:Systems:Self:Memory:DevType2_DIMM0:Name %s","DevType2_DIMM0");   
+    reply = redisMgrCommand("SET Redfish:Systems:Self:Memory:DevType2_DIMM0:Name %s","DevType2_DIMM0");   
     if (reply == NULL ) {
     	TCRIT("redis set fails\n");
+    	redisMgrRelease();
     	return -1;
     }
     	
-    reply = redisCommand(c,"SET Redfish:Systems:Self:Memory:DevType2_DIMM0:MemoryLocation:Socket %s","0");
-    reply = redisCommand(c,"SET Redfish:Systems:Self:Memory:DevType2_DIMM0:MemoryLocation:MemoryController %s","0");
-    reply = redisCommand(c,"SET Redfish:Systems:Self:Memory:DevType2_DIMM0:MemoryLocation:Channel %s","0");
-    reply = redisCommand(c,"SET Redfish:Systems:Self:Memory:DevType2_DIMM0:MemoryLocation:Slot %s","0");
-    reply = redisCommand(c,"SET Redfish:Systems:Self:Memory:DevType2_DIMM0:SerialNumber %s","00000001");
-    reply = redisCommand(c,"SET Redfish:Systems:Self:Memory:DevType2_DIMM0:Status:State %s","Enabled");
+    redisMgrAppend("SET Redfish:Systems:Self:Memory:DevType2_DIMM0:MemoryLocation:Socket %s","0");
+    redisMgrAppend("SET Redfish:Systems:Self:Memory:DevType2_DIMM0:MemoryLocation:MemoryController %s","0");
+    redisMgrAppend("SET Redfish:Systems:Self:Memory:DevType2_DIMM0:MemoryLocation:Channel %s","0");
+    redisMgrAppend("SET Redfish:Systems:Self:Memory:DevType2_DIMM0:MemoryLocation:Slot %s","0");
+    redisMgrAppend("SET Redfish:Systems:Self:Memory:DevType2_DIMM0:SerialNumber %s","00000001");
+    redisMgrAppend("SET Redfish:Systems:Self:Memory:DevType2_DIMM0:Status:State %s","Enabled");
     
-    reply = redisCommand(c,"SET Redfish:Systems:Self:Memory:DevType2_DIMM1:Name %s","DevType2_DIMM1");   
-    reply = redisCommand(c,"SET Redfish:Systems:Self:Memory:DevType2_DIMM1:MemoryLocation:Socket %s","0");
-    reply = redisCommand(c,"SET Redfish:Systems:Self:Memory:DevType2_DIMM1:MemoryLocation:MemoryController %s","0");
-    reply = redisCommand(c,"SET Redfish:Systems:Self:Memory:DevType2_DIMM1:MemoryLocation:Channel %s","0");
-    reply = redisCommand(c,"SET Redfish:Systems:Self:Memory:DevType2_DIMM1:MemoryLocation:Slot %s","1");
-    reply = redisCommand(c,"SET Redfish:Systems:Self:Memory:DevType2_DIMM1:SerialNumber %s","00000002");
-    reply = redisCommand(c,"SET Redfish:Systems:Self:Memory:DevType2_DIMM1:Status:State %s","Enabled");
+    redisMgrAppend("SET Redfish:Systems:Self:Memory:DevType2_DIMM1:Name %s","DevType2_DIMM1");   
+    redisMgrAppend("SET Redfish:Systems:Self:Memory:DevType2_DIMM1:MemoryLocation:Socket %s","0");
+    redisMgrAppend("SET Redfish:Systems:Self:Memory:DevType2_DIMM1:MemoryLocation:MemoryController %s","0");
+    redisMgrAppend("SET Redfish:Systems:Self:Memory:DevType2_DIMM1:MemoryLocation:Channel %s","0");
+    redisMgrAppend("SET Redfish:Systems:Self:Memory:DevType2_DIMM1:MemoryLocation:Slot %s","1");
+    redisMgrAppend("SET Redfish:Systems:Self:Memory:DevType2_DIMM1:SerialNumber %s","00000002");
+    redisMgrAppend("SET Redfish:Systems:Self:Memory:DevType2_DIMM1:Status:State %s","Enabled");
     
-    reply = redisCommand(c,"SET Redfish:InventoryData:PostStatus:Status %s","Completed");
-    freeReplyObject(reply);
-    redisFree(c);
+    redisMgrAppend("SET Redfish:InventoryData:PostStatus:Status %s","Completed");
+    redisMgrRelease();
     
 	return 0;
 }
 
+/* inventory keys read per enabled DIMM, in pipeline order */
+enum {
+	DIMM_INV_SOCKET = 0,
+	DIMM_INV_IMC,
+	DIMM_INV_CHANNEL,
+	DIMM_INV_SLOT,
+	DIMM_INV_SN,
+	DIMM_INV_PN,
+	DIMM_INV_FIELDS,
+};
+
+static const char *dimmInvKey[DIMM_INV_FIELDS] = {
+	"MemoryLocation:Socket",
+	"MemoryLocation:MemoryController",
+	"MemoryLocation:Channel",
+	"MemoryLocation:Slot",
+	"SerialNumber",
+	"PartNumber",
+};
+
+/* ***************************************************************
+ * Apply one inventory reply to dimm_arr[j]
+ * return : 0 on success, -1 if the inventory is not usable
+ *****************************************************************/
+static int parseDimmInvReply(redisReply *reply, int field, int i, struct mfp_dimm_entry *pDimm)
+{
+	UINT16 val;
+#ifdef CONFIG_SPX_FEATURE_MFP_2
+	char * pEnd;
+#endif
+
+	if (reply == NULL) {
+		TCRIT("ERROR, GET Redfish:Systems:%s:Memory:%s:%s, Exit \n", env_systems_name, memEntry[i], dimmInvKey[field]);
+		return -1;
+	}
+	if (reply->str == NULL) {
+		if (reply->type == REDIS_REPLY_NIL) {
+			TCRIT("Key Redfish:Systems:%s:Memory:%s:%s not exist", env_systems_name, memEntry[i], dimmInvKey[field]);
+		}
+		if (field == DIMM_INV_SN) {
+			pDimm->sn = 0xAAAAAAAA;  //default sn
+			return 0;
+		}
+		return (field == DIMM_INV_PN) ? 0 : -1;
+	}
+
+	switch (field) {
+	case DIMM_INV_SOCKET:
+	case DIMM_INV_IMC:
+	case DIMM_INV_CHANNEL:
+	case DIMM_INV_SLOT:
+		val = (UINT16)strtol((reply->str), NULL, 10);
+		if (field == DIMM_INV_SOCKET) {
+			pDimm->loc.socket = val & SOCKET_MASK;
+		}
+		else if (field == DIMM_INV_IMC) {
+			pDimm->loc.imc = val & IMC_MASK;
+		}
+		else if (field == DIMM_INV_CHANNEL) {
+			pDimm->loc.channel = val%2;    //Convert socket-based chan number to imc-based number
+		}
+		else {
+			pDimm->loc.dimm = val & DIMM_MASK;
+		}
+		break;
+
+	case DIMM_INV_SN:
+#ifdef CONFIG_SPX_FEATURE_MFP_2
+		strtol((reply->str), &pEnd, 16);
+		if(*pEnd == '-'){
+			pDimm->sn = strtoul(pEnd+1, NULL,16);
+		}
+		else{
+			TCRIT("Serial Number string %s is not according to SMBIOS Type 17 format. Eg xxxx-xxxxxxxx \n", reply->str);
+		}
+#elif defined (CONFIG_SPX_FEATURE_MFP_3)
+		//EGS Bios Redfish just give serial number in xxxxxxxx for DDR5
+		pDimm->sn = strtoul((reply->str), NULL, 16);
+		TDBG("Key Redfish:Systems:%s:Memory:%s:SerialNumber is %x\n", env_systems_name, memEntry[i], pDimm->sn);
+#endif
+		break;
+
+	case DIMM_INV_PN:
+		TINFO("DIMM PartNumber is %s\n", reply->str);
+		memset(pDimm->pn.s, 0, sizeof(pDimm->pn.s));
+		if ((size_t)reply->len <= sizeof(pDimm->pn.s)) {
+			strncpy(pDimm->pn.s, reply->str, (size_t)reply->len);
+		}
+		else{
+			TCRIT("Key Redfish:Systems:%s:Memory:%s:PartNumber: %d exceed allowable length %u\n", env_systems_name, memEntry[i],reply->len,sizeof(pDimm->pn.s));
+		}
+		break;
+	}
+	return 0;
+}
+
+/* ***************************************************************
+ * Load the DIMM inventory in two pipelined round trips: the State
+ * of every memory entry first, then the location, serial number
+ * and part number of every enabled one.
+ *****************************************************************/
 int getDimm(size_t *dimm_count, struct mfp_dimm_entry *dimm_arr, UINT16 *pDimmID)
 {
 	int i = 0;
 	int j = 0;
-    redisContext *c = NULL;
+	int field;
+	int retVal = -1;
     redisReply *reply = NULL;
-#ifdef CONFIG_SPX_FEATURE_MFP_2
-    char * pEnd;
-#endif
+    static INT8U enabled[MAX_DIMM_COUNT];
     
-    c = redisConnectUnix(REDIS_SOCK);
-    if (c->err)
+    if (redisMgrAcquire() != 0)
     {
-        redisFree(c);
         return -1;
     }
     
-    for (i=0,j=0; i<memEntryCount; i++) {
-        reply = redisCommand(c,"GET Redfish:Systems:%s:Memory:%s:Status:State", env_systems_name, memEntry[i]);       
+    for (i=0; i<memEntryCount; i++) {
+        redisMgrAppend("GET Redfish:Systems:%s:Memory:%s:Status:State", env_systems_name, memEntry[i]);
+    }
+    for (i=0; i<memEntryCount; i++) {
+        enabled[i] = 0;
+        reply = redisMgrGetReply();
+        if (reply == NULL) {
+        	TCRIT("ERROR, GET Redfish:Systems:%s:Memory:%s:Status:State, Exit \n", env_systems_name, memEntry[i]);
+        	goto DONE;
+        }
         //TDBG("reply->str = %s, reply->type = %d \n", reply->str, reply->type);
         if (reply != NULL && reply->str != NULL) {
 			if ( !strcmp(reply->str, "Enabled")) {
-				pDimmID[j] = (UINT16)i;
-				reply = redisCommand(c,"GET Redfish:Systems:%s:Memory:%s:MemoryLocation:Socket", env_systems_name, memEntry[i]);
-				if ( reply != NULL ) {
-					if (reply->str != NULL) {
-						dimm_arr[j].loc.socket = ((UINT16)strtol((reply->str), NULL, 10)) & SOCKET_MASK;
-					}
-					else {
-						if (reply->type == REDIS_REPLY_NIL) {
-							TCRIT("Key Redfish:Systems:%s:Memory:%s:MemoryLocation:Socket not exist", env_systems_name, memEntry[i]);
-						}
-						return -1;
-					}
-				}
-				else {
-					TCRIT("ERROR, GET Redfish:Systems:%s:Memory:%s:MemoryLocation:Socket, Exit \n", env_systems_name, memEntry[i]);
-					return -1;
-				}
-				
-				reply = redisCommand(c,"GET Redfish:Systems:%s:Memory:%s:MemoryLocation:MemoryController", env_systems_name, memEntry[i]);
-				if ( reply != NULL ) {
-					if (reply->str != NULL) {
-						dimm_arr[j].loc.imc = ((UINT16)strtol((reply->str), NULL, 10)) & IMC_MASK;
-					}
-					else {
-						if (reply->type == REDIS_REPLY_NIL) {
-							TCRIT("Key Redfish:Systems:%s:Memory:%s:MemoryLocation:MemoryController not exist", env_systems_name, memEntry[i]);
-						}
-						return -1;
-					}
-				}
-				else {
-					TCRIT("ERROR, GET Redfish:Systems:%s:Memory:%s:MemoryLocation:MemoryController, Exit \n", env_systems_name, memEntry[i]);
-					return -1;
-				}
-				
-				reply = redisCommand(c,"GET Redfish:Systems:%s:Memory:%s:MemoryLocation:Channel", env_systems_name, memEntry[i]);
-				if ( reply != NULL ) {
-					if (reply->str != NULL) {
-						dimm_arr[j].loc.channel = ((UINT16)strtol((reply->str), NULL, 10))%2;    //Convert socket-based chan number to imc-based number
-					}
-					else {
-						if (reply->type == REDIS_REPLY_NIL) {
-							TCRIT("Key Redfish:Systems:%s:Memory:%s:MemoryLocation:Channel not exist", env_systems_name, memEntry[i]);
-						}
-						return -1;
-					}			
-				}
-				else {
-					TCRIT("ERROR, GET Redfish:Systems:%s:Memory:%s:MemoryLocation:Channel, Exit \n", env_systems_name, memEntry[i]);
-					return -1;
-				}
-				
-				reply = redisCommand(c,"GET Redfish:Systems:%s:Memory:%s:MemoryLocation:Slot", env_systems_name, memEntry[i]);
-				if ( reply != NULL ) {
-					if (reply->str != NULL) {
-						dimm_arr[j].loc.dimm = ((UINT16)strtol((reply->str), NULL, 10)) & DIMM_MASK;
-					}
-					else {
-						if (reply->type == REDIS_REPLY_NIL) {
-							TCRIT("Key Redfish:Systems:%s:Memory:%s:MemoryLocation:Slot not exist", env_systems_name, memEntry[i]);
-						}
-						return -1;
-					}
-				}
-				else {
-					TCRIT("ERROR, GET Redfish:Systems:%s:Memory:%s:MemoryLocation:Slot, Exit \n", env_systems_name, memEntry[i]);
-					return -1;
-				}
-				
-				reply = redisCommand(c,"GET Redfish:Systems:%s:Memory:%s:SerialNumber", env_systems_name, memEntry[i]);
-				if ( reply != NULL ) {
-					if (reply->str != NULL) {
-#ifdef CONFIG_SPX_FEATURE_MFP_2
-						strtol((reply->str), &pEnd, 16);
-						if(*pEnd == '-'){
-                        	imm_arr[j].sn = strtoul(pEnd+1, NULL,16);						
-						}
-						else{
-							TCRIT("Serial Number string %s is not according to SMBIOS Type 17 format. Eg xxxx-xxxxxxxx \n", reply->str);
-						}
-#elif defined (CONFIG_SPX_FEATURE_MFP_3)
-						//EGS Bios Redfish just give serial number in xxxxxxxx for DDR5
-						dimm_arr[j].sn = strtoul((reply->str), NULL, 16);
-						TDBG("Key Redfish:Systems:%s:Memory:%s:MemoryLocation:SerialNumber is %x\n", env_systems_name, memEntry[i], dimm_arr[j].sn);
-#endif
-					}
-					else {
-						if (reply->type == REDIS_REPLY_NIL) {
-							TCRIT("Key Redfish:Systems:%s:Memory:%s:MemoryLocation:SerialNumber not exist", env_systems_name, memEntry[i]);
-						}
-						dimm_arr[j].sn = 0xAAAAAAAA;  //default sn
-					}
-
-				}
-				else {
-					TCRIT("ERROR, GET Redfish:Systems:%s:Memory:%s:SerialNumber, Exit\n", env_systems_name, memEntry[i]);
-					return -1;
-				}
-				
-				reply = redisCommand(c,"GET Redfish:Systems:%s:Memory:%s:PartNumber", env_systems_name, memEntry[i]);
-				if ( reply != NULL ) {
-					if (reply->str != NULL) {
-						TINFO("DIMM PartNumber is %s\n", reply->str);
-						memset(dimm_arr[j].pn.s, 0, sizeof(dimm_arr[j].pn.s));
-						if ((size_t)reply->len <= sizeof(dimm_arr[j].pn.s)) {
-							strncpy(dimm_arr[j].pn.s, reply->str, (size_t)reply->len);
-						}
-						else{
-							TCRIT("Key Redfish:Systems:%s:Memory:%s:PartNumber: %d exceed allowable length %u\n", env_systems_name, memEntry[i],reply->len,sizeof(dimm_arr[j].pn.s));
-						}
-					}
-					else {
-						if (reply->type == REDIS_REPLY_NIL) {
-							TCRIT("Key Redfish:Systems:%s:Memory:%s:PartNumber: not exist", env_systems_name, memEntry[i]);
-						}
-					}
-				}
-				else {
-					TCRIT("ERROR, GET Redfish:Systems:%s:Memory:%s:PartNumber, Exit\n", env_systems_name, memEntry[i]);
-					return -1;
-				}
-				
-#if defined(DEBUG)
-				TDBG("Found DIMM %i, socket=%u, imc=%u, channel=%u, dimm=%u, sn=0x%x \n", i, dimm_arr[i].loc.socket, dimm_arr[i].loc.imc,
-    			dimm_arr[j].loc.channel,dimm_arr[j].loc.dimm,dimm_arr[j].sn);
-#endif
-
-				j++;
+				enabled[i] = 1;
 			}
 			else if ( !strcmp(reply->str, "Absent")){
 #if defined(DEBUG)
@@ -1760,8 +4118,40 @@ int getDimm(size_t *dimm_count, struct mfp_dimm_entry *dimm_arr, UINT16 *pDimmID
 			}
         }
     }
-    freeReplyObject(reply);
-    redisFree(c);
+
+    for (i=0; i<memEntryCount; i++) {
+    	if (enabled[i]) {
+    		for (field=0; field<DIMM_INV_FIELDS; field++) {
+    			redisMgrAppend("GET Redfish:Systems:%s:Memory:%s:%s", env_systems_name, memEntry[i], dimmInvKey[field]);
+    		}
+    	}
+    }
+    for (i=0,j=0; i<memEntryCount; i++) {
+    	if (!enabled[i]) {
+    		continue;
+    	}
+		pDimmID[j] = (UINT16)i;
+		for (field=0; field<DIMM_INV_FIELDS; field++) {
+			reply = redisMgrGetReply();
+			if (parseDimmInvReply(reply, field, i, &dimm_arr[j]) != 0) {
+				goto DONE;
+			}
+		}
+				
+#if defined(DEBUG)
+		TDBG("Found DIMM %i, socket=%u, imc=%u, channel=%u, dimm=%u, sn=0x%x \n", i, dimm_arr[j].loc.socket, dimm_arr[j].loc.imc,
+    			dimm_arr[j].loc.channel,dimm_arr[j].loc.dimm,dimm_arr[j].sn);
+#endif
+
+		j++;
+    }
+    retVal = 0;
+
+DONE:
+    redisMgrRelease();
+    if (retVal != 0) {
+    	return retVal;
+    }
     *dimm_count = j;
     TINFO("Found %d DIMMs \n", j);
     
@@ -1777,7 +4167,6 @@ int getDimm(size_t *dimm_count, struct mfp_dimm_entry *dimm_arr, UINT16 *pDimmID
 
 int getMemEntries()
 {
-	redisContext *c = NULL;
 	redisReply *reply = NULL;
 	redisReply *rediselement = NULL;
 	char *leading = "Redfish:Systems:Self:Memory:";
@@ -1785,14 +4174,12 @@ int getMemEntries()
 	unsigned int i;
 	int ret = 0;
     
-	c = redisConnectUnix(REDIS_SOCK);
-	if (c->err)
+	if (redisMgrAcquire() != 0)
 	{
-		redisFree(c);
 		return -1;
 	}
 
-	reply = redisCommand(c,"zrange Redfish:Systems:%s:Memory:SortedIDs 0 -1", env_systems_name);
+	reply = redisMgrCommand("zrange Redfish:Systems:%s:Memory:SortedIDs 0 -1", env_systems_name);
 	if ( reply != NULL ) {
 		TDBG("reply type = %d \n", reply->type );
 		
@@ -1826,73 +4213,306 @@ int getMemEntries()
 				}
 			}
 		}
-		else {			
-			TCRIT("zrange reply type is not array\n");			
-			ret = -1;
-		}			
-	}
-	else {
-		TCRIT(" sorted id reply is NULL\n");
-		ret = -1;
+		else {			
+			TCRIT("zrange reply type is not array\n");			
+			ret = -1;
+		}			
+	}
+	else {
+		TCRIT(" sorted id reply is NULL\n");
+		ret = -1;
+	}
+    
+    redisMgrRelease();
+
+    return ret;
+}
+
+/*
+ * Inventory readiness follows keyspace notifications of the status keys on
+ * a dedicated subscriber connection when the server already publishes
+ * them. A key is re-read on every event and at least every
+ * REDIS_NOTIFY_POLL_TIME seconds. notify-keyspace-events is a server wide
+ * setting and is never changed here; without notifications the keys are
+ * polled read-only every REDIS_STATUS_POLL_TIME seconds.
+ */
+#define MAX_WAITTIME_REDIS		1200
+#define MAX_WAITTIME_INVENTORY	3000 // 100 is too short. 10 sec * No. of "reply->str = true"
+#define REDIS_SOCK_POLL_TIME	5
+#define REDIS_NOTIFY_POLL_TIME	10
+#define REDIS_STATUS_POLL_TIME	1
+#define INVENTORY_DEBOUNCE_TIME	10
+
+/* wait for REDIS_SOCK to show up, watching its directory when it exists */
+static int waitRedisSock(int *waitTime)
+{
+	char sockDir[PATH_MAX];
+	char *slash;
+	fd_set rfds;
+	struct timeval tv, t0, t1;
+	char evBuf[sizeof(struct inotify_event) + NAME_MAX + 1];
+	int fdNotify;
+
+	strncpy(sockDir, REDIS_SOCK, sizeof(sockDir) - 1);
+	sockDir[sizeof(sockDir) - 1] = '\0';
+	slash = strrchr(sockDir, '/');
+	if (slash != NULL) {
+		*slash = '\0';
+	}
+	fdNotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fdNotify >= 0 && -1 == inotify_add_watch(fdNotify, sockDir, IN_CREATE | IN_MOVED_TO)) {
+		close(fdNotify);
+		fdNotify = -1;
+	}
+
+	while ( access( REDIS_SOCK, F_OK ) != 0 ) {
+	    if ( *waitTime > MAX_WAITTIME_REDIS) {
+	    	TCRIT("Redis Sock is not ready after %d seconds, MFP exit\n", MAX_WAITTIME_REDIS);
+	    	if (fdNotify >= 0) {
+	    		close(fdNotify);
+	    	}
+	    	return -1;
+	    }
+	    getMonoTime(&t0);
+	    if (fdNotify >= 0) {
+	    	FD_ZERO(&rfds);
+	    	FD_SET(fdNotify, &rfds);
+	    	tv.tv_sec = REDIS_SOCK_POLL_TIME;
+	    	tv.tv_usec = 0;
+	    	if (select(fdNotify + 1, &rfds, NULL, NULL, &tv) > 0) {
+	    		while (read(fdNotify, evBuf, sizeof(evBuf)) > 0);
+	    	}
+	    }
+	    else {
+	    	sleep(REDIS_SOCK_POLL_TIME);
+	    }
+	    getMonoTime(&t1);
+	    *waitTime += t1.tv_sec - t0.tv_sec;
+	}
+	TDBG("[MFP] Redis Sock is ready after %d seconds\n", *waitTime);
+
+	if (fdNotify >= 0) {
+		close(fdNotify);
+	}
+	return 0;
+}
+
+/* ***************************************************************
+ * Open a connection subscribed to the keyspace events of the
+ * readiness keys, if the server publishes keyspace events for
+ * string commands
+ * return : the subscriber, NULL if notifications are unavailable
+ *****************************************************************/
+static redisContext *subscribeInventoryKeys(void)
+{
+	redisContext *sub;
+	redisReply *reply;
+	const char *flags;
+	int enabled;
+
+	if (redisMgrAcquire() != 0) {
+		return NULL;
+	}
+	reply = redisMgrCommand("CONFIG GET notify-keyspace-events");
+	if (reply == NULL || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2 || reply->element[1]->str == NULL) {
+		TWARN("Unable to read redis keyspace events, poll inventory status\n");
+		redisMgrRelease();
+		return NULL;
+	}
+	flags = reply->element[1]->str;
+	enabled = (strchr(flags, 'K') != NULL && (strchr(flags, '$') != NULL || strchr(flags, 'A') != NULL));
+	if (!enabled) {
+		TINFO("redis keyspace events \"%s\" do not cover the status keys, poll inventory status\n", flags);
+	}
+	redisMgrRelease();
+	if (!enabled) {
+		return NULL;
+	}
+
+	sub = redisConnectUnix(REDIS_SOCK);
+	if (sub == NULL || sub->err) {
+		if (sub != NULL) {
+			redisFree(sub);
+		}
+		return NULL;
+	}
+	reply = redisCommand(sub, "SUBSCRIBE __keyspace@0__:" HOST_BOOTING_KEY " __keyspace@0__:" INVENTORY_STATUS_KEY);
+	if (reply == NULL) {
+		redisFree(sub);
+		return NULL;
+	}
+	freeReplyObject(reply);
+	return sub;
+}
+
+/* consume the messages hiredis has already buffered, return their number or -1 */
+static int drainKeyspaceEvents(redisContext *sub)
+{
+	redisReply *reply = NULL;
+	int num = 0;
+
+	while (1) {
+		if (redisGetReplyFromReader(sub, (void **)&reply) != REDIS_OK) {
+			return -1;
+		}
+		if (reply == NULL) {
+			return num;
+		}
+		freeReplyObject(reply);
+		reply = NULL;
+		num++;
+	}
+}
+
+/* ***************************************************************
+ * Wait up to timeout seconds for a message on the subscriber;
+ * without one, just sleep
+ * return : 1 message, 0 timeout, -1 the subscription is broken
+ *****************************************************************/
+static int waitKeyspaceEvent(redisContext *sub, int timeout)
+{
+	fd_set rfds;
+	struct timeval tv;
+	redisReply *reply = NULL;
+	int ret;
+
+	if (sub == NULL) {
+		sleep(timeout);
+		return 0;
+	}
+	ret = drainKeyspaceEvents(sub);
+	if (ret != 0) {
+		return ret > 0 ? 1 : -1;
+	}
+	FD_ZERO(&rfds);
+	FD_SET(sub->fd, &rfds);
+	tv.tv_sec = timeout;
+	tv.tv_usec = 0;
+	ret = select(sub->fd + 1, &rfds, NULL, NULL, &tv);
+	if (ret <= 0) {
+		return (ret == 0 || errno == EINTR) ? 0 : -1;
+	}
+	if (redisGetReply(sub, (void **)&reply) != REDIS_OK) {
+		return -1;
+	}
+	freeReplyObject(reply);
+	/* the same read may have brought more messages, do not leave them for the next select() */
+	return drainKeyspaceEvents(sub) < 0 ? -1 : 1;
+}
+
+/* ***************************************************************
+ * waitInventoryKey() without keyspace events: read key every
+ * REDIS_STATUS_POLL_TIME seconds, with debounce it has to read
+ * value on every poll for debounce seconds
+ * return : 0 when ready, -1 on timeout
+ *****************************************************************/
+static int pollInventoryKey(const char *key, const char *value, int debounce, int *waitTime, int maxWait)
+{
+	char status[REDIS_LENGTH], lastStatus[REDIS_LENGTH] = "";
+	struct timeval t0, t1;
+	int readySince = -1;
+
+	while (1) {
+		status[0] = '\0';
+		if (redisMgrGetString(key, status, sizeof(status)) == 0 && strcmp(status, value) == 0) {
+			if (readySince < 0) {
+				readySince = *waitTime;
+			}
+			if (*waitTime - readySince >= debounce) {
+				return 0;
+			}
+		}
+		else {
+			readySince = -1;
+			if (status[0] != '\0' && strcmp(status, lastStatus) != 0) {
+				TINFO("%s %s\n", key, status);
+			}
+		}
+		strcpy(lastStatus, status);
+		if (*waitTime > maxWait) {
+			return -1;
+		}
+
+		getMonoTime(&t0);
+		sleep(REDIS_STATUS_POLL_TIME);
+		getMonoTime(&t1);
+		*waitTime += t1.tv_sec - t0.tv_sec;
 	}
-    
-    freeReplyObject(reply);
-    redisFree(c);
+}
 
-    return ret;
+/* ***************************************************************
+ * Wait until key reads value, re-reading it on every keyspace event.
+ * With debounce the value must then stay unchanged for debounce
+ * seconds. waitTime accumulates the seconds spent against maxWait.
+ * return : 0 when ready, -1 on timeout
+ *****************************************************************/
+static int waitInventoryKey(redisContext **sub, const char *key, const char *value, int debounce, int *waitTime, int maxWait)
+{
+	char status[REDIS_LENGTH];
+	struct timeval t0, t1;
+	int ready, ev;
+
+	while (1) {
+		if (*sub == NULL) {
+			return pollInventoryKey(key, value, debounce, waitTime, maxWait);
+		}
+		status[0] = '\0';
+		ready = (redisMgrGetString(key, status, sizeof(status)) == 0 && strcmp(status, value) == 0);
+		if (ready && debounce == 0) {
+			return 0;
+		}
+		if (!ready && status[0] != '\0') {
+			TINFO("%s %s\n", key, status);
+		}
+		if (*waitTime > maxWait) {
+			return -1;
+		}
+
+		getMonoTime(&t0);
+		ev = waitKeyspaceEvent(*sub, ready ? debounce : REDIS_NOTIFY_POLL_TIME);
+		getMonoTime(&t1);
+		*waitTime += t1.tv_sec - t0.tv_sec;
+		if (ev < 0) {
+			TWARN("redis keyspace subscription lost, poll inventory status\n");
+			redisFree(*sub);
+			*sub = NULL;
+		}
+		else if (ready && ev == 0) {
+			/* quiet for the whole debounce window, confirm the value once more */
+			if (redisMgrGetString(key, status, sizeof(status)) == 0 && strcmp(status, value) == 0) {
+				return 0;
+			}
+		}
+	}
 }
 
+/* ***************************************************************
+ * Wait for BIOS booting to complete and the host inventory in
+ * Redfish to be valid, MAX_WAITTIME_INVENTORY seconds at most
+ *****************************************************************/
 int checkInventoryDataReady()
 {
-#define MAX_WAITTIME_REDIS		1200
-#define MAX_WAITTIME_INVENTORY	3000 // 100 is too short. 10 sec * No. of "reply->str = true"
-
-	redisContext *c = NULL;
-    redisReply *reply;
-	
+	redisContext *sub = NULL;
     int	waitTime = 0;
     int retVal=0;
 
-	while ( access( REDIS_SOCK, F_OK ) != 0 ) {
-	    sleep(5);
-	    waitTime += 5;
-	    if ( waitTime > MAX_WAITTIME_REDIS) {
-	    	TCRIT("Redis Sock is not ready after %d seconds, MFP exit\n", MAX_WAITTIME_REDIS);
-	    	return -1;
-	    }
-    	TDBG("[MFP] Redis Sock is ready after %d seconds, MFP exit\n", waitTime);
+	if (waitRedisSock(&waitTime) != 0) {
+		return -1;
 	}
     
-    c = redisConnectUnix(REDIS_SOCK);
-    if (c->err)
+    if (redisMgrAcquire() != 0)
     {
-        redisFree(c);
-    	TDBG("[MFP] redisConnectUnix() failed\n");
         return -1;
     }
-    TDBG("[MFP] redisConnectUnix() done\n");
+    redisMgrRelease();
+
+    sub = subscribeInventoryKeys();
     
-    while (1) {
-    	reply = redisCommand(c,"GET Redfish:HostBooting:Status");
-		if(reply != NULL && reply->str != NULL) {
-			if (strcmp(reply->str, "false") == 0) {
-				TINFO("BIOS booting is complete\n");
-				break;
-			}
-			else {
-				TINFO("Redfish:HostBooting:Status %s\n", reply->str);
-				sleep(10);
-				waitTime +=10;
-			}
-		}
-		else {
-			sleep(5);
-			waitTime +=5;
-		}
-		if (waitTime > MAX_WAITTIME_INVENTORY) {
-			retVal = -1;
-			break;
-		}
+    if (waitInventoryKey(&sub, HOST_BOOTING_KEY, "false", 0, &waitTime, MAX_WAITTIME_INVENTORY) == 0) {
+    	TINFO("BIOS booting is complete\n");
+    }
+    else {
+    	retVal = -1;
     }
     
     /* 
@@ -1900,206 +4520,501 @@ int checkInventoryDataReady()
      * initialized Completed when HostBooting:Status is false after power cycle.
      * However Redfish:InventoryData:PostStatus:Status changes to BootInProgress 
      * if dimms are added or removed between power cycles.
-     * The waiting time and the subsequent checking Redfish:InventoryData:PostStatus:Status 
-     * ensure host inventory is really updated.
+     * Completed has to hold for INVENTORY_DEBOUNCE_TIME without any change
+     * to the key to ensure host inventory is really updated.
      */
-    sleep(60);
-    
-    while (1) {
-    	reply = redisCommand(c,"GET Redfish:InventoryData:PostStatus:Status");
-		if(reply != NULL && reply->str != NULL) {
-			if (strcmp(reply->str, "Completed") == 0) {
-				TINFO("BIOS Inventory Data is ready\n");
-				break;
-			}
-			else {
-				TWARN("Redfish:InventoryData:PostStatus:Status %s\n", reply->str);
-				sleep(10);
-				waitTime +=10;
-			}
+    if (waitInventoryKey(&sub, INVENTORY_STATUS_KEY, "Completed", INVENTORY_DEBOUNCE_TIME, &waitTime, MAX_WAITTIME_INVENTORY) == 0) {
+    	TINFO("BIOS Inventory Data is ready\n");
+    }
+    else {
+    	retVal = -1;
+    }
+
+    if (sub != NULL) {
+    	redisFree(sub);
+    }
+    return retVal;
+}
+
+/* ***************************************************************
+ * Drain a non-blocking record FIFO into its receive buffer
+ * return : bytes read, 0 if the pipe is empty, -1 on read error
+ *****************************************************************/
+int readPipeRecords(struct mfp_pipe_rx *rx)
+{
+	char *buf = (char *)rx->buf;
+	int total = 0;
+	int readByte = 0;
+
+	while (rx->len < sizeof(rx->buf)) {
+		readByte = sigwrap_read(rx->fd, buf + rx->len, sizeof(rx->buf) - rx->len);
+		if (readByte > 0) {
+			rx->len += readByte;
+			total += readByte;
+		}
+		else if (readByte == 0 || errno == EAGAIN || errno == EWOULDBLOCK) {
+			break;
 		}
 		else {
-			sleep(5);
-			waitTime +=5;
+			TCRIT("reading pipe gets error %d\n", errno);
+			return -1;
+		}
+	}
+	return total;
+}
+
+/* drop the first recNum records from the receive buffer */
+static void consumePipeRecords(struct mfp_pipe_rx *rx, int recNum)
+{
+	size_t used = recNum * rx->recSize;
+
+	memmove(rx->buf, (char *)rx->buf + used, rx->len - used);
+	rx->len -= used;
+}
+
+/* ***************************************************************
+ * Push every complete MFPQUEUE record held in the receive buffer
+ * into the new error batch with a single lock
+ * return : number of records delivered
+ *****************************************************************/
+int deliverPipeErrors(struct mfp_pipe_rx *rx)
+{
+	struct mfp_error *err = (struct mfp_error *)rx->buf;
+	int recNum = rx->len / rx->recSize;
+	int pushed = 0;
+	int i;
+	INT8U newRec[PIPE_RX_MAX_ERRS];
+
+	if (recNum == 0) {
+		return 0;
+	}
+
+	lockMfpDataProducer();
+	pushed = pushNewErrs(err, recNum, newRec);
+	TDBG(" Get Data mfp: %d records, newErrNum = %d\n", pushed, fillErrBatch->num);
+	pthread_mutex_unlock(&mfpDataMutex);
+	if (pushed < recNum) {
+		TWARN("drop %d mfp data records\n", recNum - pushed);
+	}
+
+	for (i=0; i<pushed; i++) {
+#ifdef DEBUG
+		TDBG("\t[%d] skt %d imc %d ch %d dimm %d rank %d device %d bg %d bank %d row 0x%x col 0x%x", i
+			, err[i].socket, err[i].imc,  err[i].channel
+			, err[i].dimm,   err[i].rank, err[i].device, err[i].bank_group
+			, err[i].bank,   err[i].row,  err[i].col);
+#endif
+	}
+	queueMFPSELEntries(err, newRec, pushed);
+	consumePipeRecords(rx, recNum);
+	return pushed;
+}
+
+/* ***************************************************************
+ * Push every complete MFPVALQUEUE record held in the receive buffer
+ * into the new validation error batch with a single lock
+ * return : number of records delivered
+ *****************************************************************/
+int deliverPipeValErrors(struct mfp_pipe_rx *rx)
+{
+	int recNum = rx->len / rx->recSize;
+	int pushed = 0;
+
+	if (recNum == 0) {
+		return 0;
+	}
+
+	lockMfpDataProducer();
+	pushed = pushNewValErrs((mfpval_error *)rx->buf, recNum);
+	pthread_mutex_unlock(&mfpDataMutex);
+	TDBG(" Get Data mfp validation: %d records\n", pushed);
+	if (pushed < recNum) {
+		TWARN("drop %d mfp validation records\n", recNum - pushed);
+	}
+
+	consumePipeRecords(rx, recNum);
+	return pushed;
+}
+
+static int setMainEpoll(int fdEpoll, int op, int fd, uint32_t events, int tag)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.u32 = tag;
+	return epoll_ctl(fdEpoll, op, fd, &ev);
+}
+
+/* ***************************************************************
+ * Consume the inotify events on the MFP_VAL_KEY directory
+ * return : 1 if one of them is about MFP_VAL_KEY itself
+ *****************************************************************/
+static int readValKeyEvents(int fdNotify, const char *keyName)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+	int hit = 0;
+
+	while ((len = read(fdNotify, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if ((ev->mask & IN_Q_OVERFLOW) || (ev->len && !strcmp(ev->name, keyName))) {
+				hit = 1;
+			}
+		}
+	}
+	return hit;
+}
+
+int getRedfishEnv()
+{
+	redisReply *reply;
+	
+	if (redisMgrAcquire() != 0)
+	{
+		return -1;
+	}
+	
+	reply = redisMgrCommand("GET ENV:SystemSelf");
+	if(reply != NULL && reply->str != NULL && reply->len < sizeof(env_systems_name)) {
+		memcpy(env_systems_name, reply->str, reply->len);
+	}
+	else {
+		//Only Self is allowed RTPVersion <=RTP1.5 
+		memcpy(env_systems_name, "Self", strlen("Self"));
+	}
+	TDBG(" SystemSelf is %s \n", env_systems_name);
+
+	redisMgrRelease();
+	return 0;
+}
+
+int MemErrorStructToMFPError(MemErrorStruct  *pIPMIErr, struct mfp_error *pMFPErr)
+{
+	if ( (pIPMIErr == NULL) || (pMFPErr == NULL) ) {
+		TCRIT(" pIPMIErr == NULL) or pMFPError == NULL");
+		return -1;
+	}
+	pMFPErr->socket = pIPMIErr->socket & SOCKET_MASK;
+	pMFPErr->imc = pIPMIErr->imc & IMC_MASK;
+	pMFPErr->channel = pIPMIErr->channel & IMC_BASE_CHANNEL_MASK;
+	pMFPErr->dimm = pIPMIErr->slot & DIMM_MASK;
+	pMFPErr->rank = pIPMIErr->rank & RANK_MASK;
+	pMFPErr->device = pIPMIErr->device & DEVICE_MASK;
+	pMFPErr->bank_group = pIPMIErr->bankGroup & BG_MASK;
+	pMFPErr->bank = pIPMIErr->bank & BANK_MASK;
+	pMFPErr->row = pIPMIErr->row & ROW_MASK;
+	pMFPErr->col = pIPMIErr->col & COLUMN_MASK;
+	pMFPErr->error_type = pIPMIErr->errorType & UE_MASK;
+	pMFPErr->par_syn = pIPMIErr->paritySyndrome;
+	pMFPErr->mode = pIPMIErr->mode & MODE_MASK;
+	return 0;
+}
+
+int getCPUNrTypeAndBus(INT8U *CPUCount, CpuTypes *cpu_type, INT8U *busNumber)
+{
+	INT8U i=0;
+	INT8U CPUs=0;
+	
+	for (CPUs=0; CPUs<MAX_AMOUNT_OF_CPUS;CPUs++) {
+		if( 0 == peci_Ping(MIN_CPU_ADDRESS + CPUs) )  {
+			TINFO("Ping address 0x%x Success\n", (MIN_CPU_ADDRESS + CPUs));
 		}
-		if (waitTime > MAX_WAITTIME_INVENTORY) {
-			retVal = -1;
+		else {
 			break;
 		}
-    }
-    
-	freeReplyObject(reply);
-	redisFree(c);
+	}
+	if ( CPUs == 0 ) {
+		TCRIT("No CPU is detected by PECI PING\n");
+		return -1;;
+	}
+	
+	*CPUCount = CPUs;
+	
+	for (i=0; i<CPUs;i++)  {
+	    if ( 0 != ValidatePECIBus(i) || 0 !=  DetectCpuType(i, &cpu_type[i]) || 0 != RetrievePECIBus(i, &busNumber[i])) {
+	    	TCRIT("CPU %d: Bus validation & CPU detection failed\n", i);
+	    	return -1;
+	    }
+	
+#ifdef wakePECIAfterHostReset
+		if ( 0 != WakePECI(i) ) {
+			return -1;
+		}
+#endif
+	}
 
-    return retVal;
+	return 0;
+}
+
+/* ***************************************************************
+ * Channel topology of a backend taken from the unique
+ * (socket, imc, channel) tuples in dimmArray
+ * return : number of channels to poll
+ *****************************************************************/
+int buildDimmChannelTopology(const struct mfp_collect_backend *backend, struct mfp_poll_chan *chans, int maxChans)
+{
+	size_t i;
+	int k, chanCnt = 0;
+
+	for (i=0; i<dimmCount && chanCnt<maxChans; i++) {
+		for (k=0; k<chanCnt; k++) {
+			if (chans[k].socket == dimmArray[i].loc.socket && chans[k].imc == dimmArray[i].loc.imc
+					&& chans[k].channel == dimmArray[i].loc.channel) {
+				break;
+			}
+		}
+		if (k == chanCnt) {
+			memset(&chans[k], 0, sizeof(chans[k]));
+			chans[k].backend = backend;
+			chans[k].socket = (INT8U)dimmArray[i].loc.socket;
+			chans[k].imc = (INT8U)dimmArray[i].loc.imc;
+			chans[k].channel = (INT8U)dimmArray[i].loc.channel;
+			chanCnt++;
+		}
+	}
+	TINFO("%s PECI poll schedule: %d channels for %u DIMMs\n", backend->name, chanCnt, dimmCount);
+	return chanCnt;
+}
+
+/* pick the next poll time of a channel from the errors its last poll found */
+static void schedulePollChan(struct mfp_poll_chan *chan, int errFound, unsigned long long nowMs)
+{
+	chan->errScore -= chan->errScore >> POLL_SCORE_DECAY_SHIFT;
+	chan->errScore += errFound * POLL_SCORE_UNIT;
+
+	if (errFound || chan->errScore >= POLL_HOT_SCORE) {
+		chan->intervalMs = 0;
+	}
+	else if (chan->intervalMs == 0) {
+		chan->intervalMs = POLL_BASE_INTERVAL_MS;
+	}
+	else if (chan->intervalMs < POLL_MAX_INTERVAL_MS) {
+		chan->intervalMs *= 2;
+		if (chan->intervalMs > POLL_MAX_INTERVAL_MS) {
+			chan->intervalMs = POLL_MAX_INTERVAL_MS;
+		}
+	}
+	chan->nextPollMs = nowMs + chan->intervalMs;
+}
+
+/* sleep until the earliest channel is due, at most POLL_MAX_INTERVAL_MS */
+static void waitPollSchedule(struct mfp_poll_chan *chans, int chanCnt)
+{
+	unsigned long long nowMs = getMonoMs();
+	unsigned long long dueMs = nowMs + POLL_MAX_INTERVAL_MS;
+	struct timespec ts;
+	int k;
+
+	for (k=0; k<chanCnt; k++) {
+		if (chans[k].nextPollMs < dueMs) {
+			dueMs = chans[k].nextPollMs;
+		}
+	}
+	if (dueMs > nowMs) {
+		ts.tv_sec = (dueMs - nowMs) / 1000;
+		ts.tv_nsec = ((dueMs - nowMs) % 1000) * 1000000;
+		nanosleep(&ts, NULL);
+	}
+}
+
+static void probeDdrRange(INT8U iCPU, INT8U *imcCount, INT8U *chanCount)
+{
+	UN_USED(iCPU);
+	*imcCount = NUMBER_OF_IMCS;
+	*chanCount = NUMBER_OF_CHANNELS;
+}
+
+static int initDdrChannel(INT8U iCPU, INT8U iIMC, INT8U iChan)
+{
+	INT32	retVal = 0;
+
+	retVal = RecognizeTypeOfErrorsStoredInRetryLogRegisters(iCPU, bus[iCPU], iIMC, iChan);
+#if defined CONFIG_SPX_FEATURE_MFP_3_1
+	retVal = InitializeRetryRdErrLogValues(iCPU, bus[iCPU], iIMC, iChan);
+	if(retVal == -1) {
+		TCRIT("InitializeRetryRdErrLogValues(cpu %d imc %d chan %d) failed\n",iCPU, iIMC, iChan);
+	}
+	else
+	{
+		TINFO("InitializeRetryRdErrLogValues(cpu %d imc %d chan %d) is done\n",iCPU, iIMC, iChan);
+		retVal = 0;
+	}
+	TryToInitializeErrorHandlingForDimm(iCPU, bus[iCPU], iIMC, iChan);
+#endif
+	return retVal;
+}
+
+static void lookForDdrErrors(struct mfp_poll_chan *chan, MemErrorStruct *memErr, bool *validError)
+{
+	/* coverity[sleep : FALSE] */
+	LookForErrors(bus[chan->socket], type[chan->socket], chan->socket, chan->imc, chan->channel, memErr, validError);
+}
+
+#if defined CONFIG_SPX_FEATURE_MFP_3_1 && defined (MRT_CPU_HBM)
+/* MRT3.1 specific to HBM*/
+/* the HBM range follows the CPU type; other types have no HBM to probe */
+static void probeHbmRange(INT8U iCPU, INT8U *imcCount, INT8U *chanCount)
+{
+	if (type[iCPU] == HBM_CPU_TYPE) {
+		*imcCount = HBM_NUMBER_OF_IMCS;
+		*chanCount = HBM_NUMBER_OF_CHANNELS;
+	}
+	else {
+		TINFO("HBM cpu %d type %d has no HBM, not probed\n", iCPU, type[iCPU]);
+		*imcCount = 0;
+		*chanCount = 0;
+	}
 }
 
-int checkPipeDataAvail(int fdPipe, struct timeval *pTimeout)
+/* a channel of an HBM socket whose retry-log registers initialize joins hbmTopology */
+static int initHbmChannel(INT8U iCPU, INT8U iIMC, INT8U iChan)
 {
-    fd_set	fdRead;
-    
-    FD_ZERO (&fdRead);
-    FD_SET (fdPipe, &fdRead);
-
-    return sigwrap_select (fdPipe + 1, &fdRead, NULL, NULL, pTimeout);   
-}
+	INT32	retVal;
 
-int getRedfishEnv()
-{
-	redisContext *c = NULL;
-	redisReply *reply;
-	
-	c = redisConnectUnix(REDIS_SOCK);
-	if (c->err)
+	retVal  = RecognizeTypeOfErrorsStoredInRetryLogRegistersHbm(iCPU, bus[iCPU], iIMC, iChan);
+	retVal += InitializeRetryRdErrLogValuesHbm(iCPU, bus[iCPU], iIMC, iChan);
+	if(retVal)
 	{
-		redisFree(c);
-		return -1;
-	}
-	
-	reply = redisCommand(c,"GET ENV:SystemSelf");
-	if(reply->str != NULL) {
-		memcpy(env_systems_name, reply->str, strlen(reply->str));
+		TCRIT("HBM cpu %d imc %d ch %d initialization failed - return %d, not polled\n",
+				iCPU, iIMC, iChan, retVal);
 	}
-	else {
-		//Only Self is allowed RTPVersion <=RTP1.5 
-		memcpy(env_systems_name, "Self", strlen("Self"));
+	else if (hbmChanCount < MAX_HBM_CHAN_COUNT) {
+		hbmTopology[hbmChanCount].socket = iCPU;
+		hbmTopology[hbmChanCount].imc = iIMC;
+		hbmTopology[hbmChanCount].channel = iChan;
+		hbmChanCount++;
 	}
-	TDBG(" SystemSelf is %s \n", env_systems_name);
-
-	freeReplyObject(reply);
-	redisFree(c);	
-	return 0;
+	return retVal;
 }
 
-int MemErrorStructToMFPError(MemErrorStruct  *pIPMIErr, struct mfp_error *pMFPErr)
+int buildHbmChannelTopology(const struct mfp_collect_backend *backend, struct mfp_poll_chan *chans, int maxChans)
 {
-	if ( (pIPMIErr == NULL) || (pMFPErr == NULL) ) {
-		TCRIT(" pIPMIErr == NULL) or pMFPError == NULL");
-		return -1;
+	int k;
+
+	for (k=0; k<hbmChanCount && k<maxChans; k++) {
+		memset(&chans[k], 0, sizeof(chans[k]));
+		chans[k].backend = backend;
+		chans[k].socket = hbmTopology[k].socket;
+		chans[k].imc = hbmTopology[k].imc;
+		chans[k].channel = hbmTopology[k].channel;
 	}
-	pMFPErr->socket = pIPMIErr->socket & SOCKET_MASK;
-	pMFPErr->imc = pIPMIErr->imc & IMC_MASK;
-	pMFPErr->channel = pIPMIErr->channel & IMC_BASE_CHANNEL_MASK;
-	pMFPErr->dimm = pIPMIErr->slot & DIMM_MASK;
-	pMFPErr->rank = pIPMIErr->rank & RANK_MASK;
-	pMFPErr->device = pIPMIErr->device & DEVICE_MASK;
-	pMFPErr->bank_group = pIPMIErr->bankGroup & BG_MASK;
-	pMFPErr->bank = pIPMIErr->bank & BANK_MASK;
-	pMFPErr->row = pIPMIErr->row & ROW_MASK;
-	pMFPErr->col = pIPMIErr->col & COLUMN_MASK;
-	pMFPErr->error_type = pIPMIErr->errorType & UE_MASK;
-	pMFPErr->par_syn = pIPMIErr->paritySyndrome;
-	pMFPErr->mode = pIPMIErr->mode & MODE_MASK;
-	return 0;
+	TINFO("%s PECI poll schedule: %d channels discovered\n", backend->name, k);
+	return k;
 }
 
-int getCPUNrTypeAndBus(INT8U *CPUCount, CpuTypes *cpu_type, INT8U *busNumber)
+static void lookForHbmErrors(struct mfp_poll_chan *chan, MemErrorStruct *memErr, bool *validError)
 {
-	INT8U i=0;
-	INT8U CPUs=0;
-	
-	for (CPUs=0; CPUs<MAX_AMOUNT_OF_CPUS;CPUs++) {
-		if( 0 == peci_Ping(MIN_CPU_ADDRESS + CPUs) )  {
-			TINFO("Ping address 0x%x Success\n", (MIN_CPU_ADDRESS + CPUs));
-		}
-		else {
-			break;
-		}
+	/* coverity[sleep : FALSE] */
+	LookForErrorsHbm(bus[chan->socket], type[chan->socket], chan->socket, chan->imc, chan->channel, memErr, validError);
+}
+#endif
+
+static const struct mfp_collect_backend collectBackends[] = {
+	{ "DDR", probeDdrRange, initDdrChannel, lookForDdrErrors, buildDimmChannelTopology },
+#if defined CONFIG_SPX_FEATURE_MFP_3_1 && defined (MRT_CPU_HBM)
+	{ "HBM", probeHbmRange, initHbmChannel, lookForHbmErrors, buildHbmChannelTopology },
+#endif
+};
+
+static int comparePollChanSocket(const void *a, const void *b)
+{
+	const struct mfp_poll_chan *ca = (const struct mfp_poll_chan *)a;
+	const struct mfp_poll_chan *cb = (const struct mfp_poll_chan *)b;
+
+	if (ca->socket != cb->socket) {
+		return (int)ca->socket - (int)cb->socket;
 	}
-	if ( CPUs == 0 ) {
-		TCRIT("No CPU is detected by PECI PING\n");
-		return -1;;
+	if (ca->backend != cb->backend) {
+		return (ca->backend < cb->backend) ? -1 : 1;
 	}
-	
-	*CPUCount = CPUs;
-	
-	for (i=0; i<CPUs;i++)  {
-	    if ( 0 != ValidatePECIBus(i) || 0 !=  DetectCpuType(i, &cpu_type[i]) || 0 != RetrievePECIBus(i, &busNumber[i])) {
-	    	TCRIT("CPU %d: Bus validation & CPU detection failed\n", i);
-	    	return -1;
-	    }
-	
-#ifdef wakePECIAfterHostReset
-		if ( 0 != WakePECI(i) ) {
-			return -1;
-		}
-#endif
+	if (ca->imc != cb->imc) {
+		return (int)ca->imc - (int)cb->imc;
 	}
-
-	return 0;
+	return (int)ca->channel - (int)cb->channel;
 }
 
-void *mfp2Thread(void *pArg) 
+/* ***************************************************************
+ * PECI CE collector of one socket. Each socket runs its own worker
+ * over its slice of the merged DDR/HBM poll schedule, so a slow
+ * socket no longer delays the others and all PECI traffic of a
+ * socket comes from one thread. Errors merge into the shared batch.
+ *****************************************************************/
+void *mfp2SocketThread(void *pArg)
 {
-	UN_USED(pArg);
-	INT8U	i, iCPU, iIMC, iChan, iSet;
+	struct mfp_socket_worker *worker = (struct mfp_socket_worker *)pArg;
+	INT8U	iCPU = worker->socket;
+	INT8U	iSet;
 	MemErrorStruct memErr[NUMBER_OF_MMIO_REGISTERS_SETS];
 	bool validError[NUMBER_OF_MMIO_REGISTERS_SETS] = {false};
-	struct mfp_error err = {0};
+	struct mfp_error err[NUMBER_OF_MMIO_REGISTERS_SETS];
+	INT8U	newRec[NUMBER_OF_MMIO_REGISTERS_SETS];
 	INT32U	peciEn = 0;
-	INT8U	j;
 	INT32	retVal = 0;
-	
-	prctl(PR_SET_NAME,__FUNCTION__,0,0,0);
-
-	TINFO("%s() Line %d: Pass PECI CPU Commands\n",__FUNCTION__, __LINE__);
-	for (iCPU=0; iCPU<nrCPU; iCPU++) {
-		for (iIMC=0; iIMC<NUMBER_OF_IMCS; iIMC++) {
-			for (iChan=0; iChan<NUMBER_OF_CHANNELS; iChan++) {
-				retVal = RecognizeTypeOfErrorsStoredInRetryLogRegisters(iCPU, bus[iCPU], iIMC, iChan);
-#if defined CONFIG_SPX_FEATURE_MFP_3_1
-				retVal = InitializeRetryRdErrLogValues(iCPU, bus[iCPU], iIMC, iChan);
-				if(retVal == -1) {
-					TCRIT("InitializeRetryRdErrLogValues(cpu %d imc %d chan %d) failed\n",iCPU, iIMC, iChan);
-				}
-				else
-				{
-					TINFO("InitializeRetryRdErrLogValues(cpu %d imc %d chan %d) is done\n",iCPU, iIMC, iChan);
-				}
-				TryToInitializeErrorHandlingForDimm(iCPU, bus[iCPU], iIMC, iChan);
+	int		k, errFound, pushed, polled;
+	unsigned long long nowMs;
+	struct mfp_poll_chan *chan;
+	char	threadName[16];
+#if defined (TRACK_DETECTED_CORR_ERROR) && defined (MRT_DEBUG_TIME_STAMP)
+	struct timeval mrt_t0, mrt_t1;
 #endif
-			}
-		}
-	}
+
+	snprintf(threadName, sizeof(threadName), "mfp2Socket%u", iCPU);
+	prctl(PR_SET_NAME,threadName,0,0,0);
+	TINFO("%s polls %d channels\n", threadName, worker->chanCount);
 
 	while (1) {
-		for (i=0; i<dimmCount; i++) {
-			if (newErrNum < MAX_NEWERR-1) {
+		nowMs = getMonoMs();
+		polled = 0;
+		for (k=0; k<worker->chanCount; k++) {
+			chan = &worker->chans[k];
+			if (chan->nextPollMs > nowMs) {
+				continue;
+			}
 #if defined (TRACK_DETECTED_CORR_ERROR) && defined (MRT_DEBUG_TIME_STAMP)
-				gettimeofday(&mrt_t0, 0);
+			gettimeofday(&mrt_t0, 0);
 #endif
-				pthread_mutex_lock(&mfpDataMutex);
-				iCPU = (INT8U)dimmArray[i].loc.socket;
-				iIMC = (INT8U)dimmArray[i].loc.imc;
-				iChan = (INT8U)dimmArray[i].loc.channel;
-				/* coverity[sleep : FALSE] */
-				LookForErrors(bus[iCPU], type[iCPU], iCPU, iIMC, iChan, memErr, validError);
-				for (iSet=0; iSet<NUMBER_OF_MMIO_REGISTERS_SETS; iSet++) {
-					/*******************************************************************************
-					 * CE is collected; If non-fatal UCE that is not handled by host, we will collect it here
-					 * Fatal UCE is handled by host, and is sent via ipmi oem command by BIOS
-					 ******************************************************************************/
-					if ( validError[iSet] ) {
-						TDBG("validError[%u] true", iSet);
-						MemErrorStructToMFPError(&memErr[iSet], &err);						
-						memcpy(&newErr[newErrNum], &err, sizeof(err));
-						newErrNum++;
-						validError[iSet]=false;
-						gettimeofday(&tlastErr, NULL);
-						AddMFPSELEntries(&err);						
-					}
+			pthread_mutex_lock(&worker->peciMutex);
+			chan->backend->lookForErrors(chan, memErr, validError);
+			pthread_mutex_unlock(&worker->peciMutex);
+
+			errFound = 0;
+			for (iSet=0; iSet<NUMBER_OF_MMIO_REGISTERS_SETS; iSet++) {
+				/*******************************************************************************
+				 * CE is collected; If non-fatal UCE that is not handled by host, we will collect it here
+				 * Fatal UCE is handled by host, and is sent via ipmi oem command by BIOS
+				 ******************************************************************************/
+				if ( validError[iSet] ) {
+					TDBG("%s validError[%u] true", chan->backend->name, iSet);
+					MemErrorStructToMFPError(&memErr[iSet], &err[errFound++]);
+					validError[iSet]=false;
 				}
+			}
+
+			if (errFound) {
+				lockMfpDataProducer();
+				pushed = pushNewErrs(err, errFound, newRec);
 				pthread_mutex_unlock(&mfpDataMutex);
+				if (pushed < errFound) {
+					TWARN("overflow queue is full, drop %d errors\n", errFound - pushed);
+				}
+				queueMFPSELEntries(err, newRec, pushed);
+			}
+			schedulePollChan(chan, errFound, getMonoMs());
+			polled++;
 #if defined (TRACK_DETECTED_CORR_ERROR) && defined (MRT_DEBUG_TIME_STAMP)
-				gettimeofday(&mrt_t1, 0);
-				long elapsed = (mrt_t1.tv_sec-mrt_t0.tv_sec)*1000000 + mrt_t1.tv_usec-mrt_t0.tv_usec;
-				printf("Elapsed LookForErrors() time %ld sec, %ld usec\n", elapsed/1000000, elapsed);
+			gettimeofday(&mrt_t1, 0);
+			long elapsed = (mrt_t1.tv_sec-mrt_t0.tv_sec)*1000000 + mrt_t1.tv_usec-mrt_t0.tv_usec;
+			printf("Elapsed LookForErrors() time %ld sec, %ld usec\n", elapsed/1000000, elapsed);
 #endif
-			}
-			else {
-				TDBG("Wait for MFP Data finish processing\n");
-				sleep(1);
-			}	
+		}
+
+		if (!polled) {
+			waitPollSchedule(worker->chans, worker->chanCount);
+			continue;
 		}
 
 		/*
@@ -2108,92 +5023,129 @@ void *mfp2Thread(void *pArg)
 		 */
 		/*sleep(WaitSecondsPeriodBetweenErrorPooling);*/
 
-		for (j=0; j<nrCPU;j++)  {
-			retVal = isPECIEnabled(j, &peciEn);
-			if (retVal==0 && peciEn==0) {
-				WakePECI(j);
-			}
+		/* once per CPU and cycle for all backends */
+		pthread_mutex_lock(&worker->peciMutex);
+		retVal = isPECIEnabled(iCPU, &peciEn);
+		if (retVal==0 && peciEn==0) {
+			WakePECI(iCPU);
 		}
+		pthread_mutex_unlock(&worker->peciMutex);
 	}
 	return NULL;
 }
 
-#if defined CONFIG_SPX_FEATURE_MFP_3_1 && defined (MRT_CPU_HBM)
-/* MRT3.1 specific to HBM*/
-void *mfp2ThreadHbm(void *pArg)
+void *mfp2Thread(void *pArg) 
 {
 	UN_USED(pArg);
-	INT8U	i, iCPU, iIMC, iChan, iSet;
-	MemErrorStruct memErr[NUMBER_OF_MMIO_REGISTERS_SETS];
-	bool validError[NUMBER_OF_MMIO_REGISTERS_SETS] = {false};
-	struct mfp_error err = {0};
-	INT32U	peciEn = 0;
-	INT8U	j;
-	INT32	retVal;
+	INT8U	iCPU, iIMC, iChan, imcCount, chanCount;
+	size_t	b;
+	int		k;
 	
 	prctl(PR_SET_NAME,__FUNCTION__,0,0,0);
 
+	TINFO("%s() Line %d: Pass PECI CPU Commands\n",__FUNCTION__, __LINE__);
 	for (iCPU=0; iCPU<nrCPU; iCPU++) {
-		for (iIMC=0; iIMC<NUMBER_OF_IMCS; iIMC++) {
-			for (iChan=0; iChan<NUMBER_OF_CHANNELS; iChan++) {
-				retVal  = RecognizeTypeOfErrorsStoredInRetryLogRegistersHbm(iCPU, bus[iCPU], iIMC, iChan);
-				retVal += InitializeRetryRdErrLogValuesHbm(iCPU, bus[iCPU], iIMC, iChan);
-				if(retVal)
-				{
-					TCRIT("HBM cpu %d imc %d ch %d initialization failed - return %d\n",
-							iCPU, iIMC, iChan, retVal);
+		pthread_mutex_init(&socketWorker[iCPU].peciMutex, NULL);
+	}
+	for (b=0; b<sizeof(collectBackends)/sizeof(collectBackends[0]); b++) {
+		for (iCPU=0; iCPU<nrCPU; iCPU++) {
+			collectBackends[b].probeRange(iCPU, &imcCount, &chanCount);
+			pthread_mutex_lock(&socketWorker[iCPU].peciMutex);
+			for (iIMC=0; iIMC<imcCount; iIMC++) {
+				for (iChan=0; iChan<chanCount; iChan++) {
+					collectBackends[b].initChannel(iCPU, iIMC, iChan);
 				}
 			}
+			pthread_mutex_unlock(&socketWorker[iCPU].peciMutex);
 		}
 	}
 
-	while (1) {
-		for (i=0; i<dimmCount; i++) {
-			if (newErrNum < MAX_NEWERR-1) {
-				pthread_mutex_lock(&mfpDataMutex);
-				iCPU = (INT8U)dimmArray[i].loc.socket;
-				iIMC = (INT8U)dimmArray[i].loc.imc;
-				iChan = (INT8U)dimmArray[i].loc.channel;
-				/* coverity[sleep : FALSE] */
-				LookForErrorsHbm(bus[iCPU], type[iCPU], iCPU, iIMC, iChan, memErr, validError);
-				for (iSet=0; iSet<NUMBER_OF_MMIO_REGISTERS_SETS; iSet++) {
-					/*******************************************************************************
-					 * CE is collected; If non-fatal UCE that is not handled by host, we will collect it here
-					 * Fatal UCE is handled by host, and is sent via ipmi oem command by BIOS
-					 ******************************************************************************/
-					if ( validError[iSet] ) {
-						TDBG("HBM validError[%u] true", iSet);
-						MemErrorStructToMFPError(&memErr[iSet], &err);						
-						memcpy(&newErr[newErrNum], &err, sizeof(err));
-						newErrNum++;
-						validError[iSet]=false;
-						gettimeofday(&tlastErr, NULL);
-						AddMFPSELEntries(&err);						
-					}
-				}
-				pthread_mutex_unlock(&mfpDataMutex);
-			}
-			else {
-				TDBG("HBM Wait for MFP Data finish processing\n");
-				sleep(1);
-			}	
+	pollChanCount = 0;
+	for (b=0; b<sizeof(collectBackends)/sizeof(collectBackends[0]); b++) {
+		pollChanCount += collectBackends[b].buildTopology(&collectBackends[b], &pollChan[pollChanCount], MAX_POLL_CHAN_COUNT - pollChanCount);
+	}
+
+	/* hand every socket its contiguous slice of the schedule */
+	qsort(pollChan, pollChanCount, sizeof(pollChan[0]), comparePollChanSocket);
+	for (k=0; k<pollChanCount; k++) {
+		iCPU = pollChan[k].socket;
+		if (iCPU >= nrCPU) {
+			TCRIT("channel socket %u exceeds detected CPU number %u, not polled\n", iCPU, nrCPU);
+			continue;
+		}
+		if (socketWorker[iCPU].chanCount == 0) {
+			socketWorker[iCPU].socket = iCPU;
+			socketWorker[iCPU].chans = &pollChan[k];
 		}
+		socketWorker[iCPU].chanCount++;
+	}
 
-		/*
-		 * The sleep prevents the BMC from detecting many CE bursts..
-		 * MFP thread doesn't use much CPU resource, so remove the sleep.
-		 */
-		/*sleep(WaitSecondsPeriodBetweenErrorPooling);*/
-		for (j=0; j<nrCPU;j++)  {
-			retVal = isPECIEnabled(j, &peciEn);
-			if (retVal==0 && peciEn==0) {
-				WakePECI(j);
-			}
+	for (iCPU=0; iCPU<nrCPU; iCPU++) {
+		if (socketWorker[iCPU].chanCount == 0) {
+			continue;
+		}
+		if (0 != pthread_create(&socketWorker[iCPU].tid, NULL, mfp2SocketThread, &socketWorker[iCPU])) {
+			TCRIT("Unable create mfp socket %u collect thread\n", iCPU);
+			socketWorker[iCPU].chanCount = 0;
+		}
+	}
+
+	for (iCPU=0; iCPU<nrCPU; iCPU++) {
+		if (socketWorker[iCPU].chanCount) {
+			pthread_join(socketWorker[iCPU].tid, NULL);
 		}
 	}
 	return NULL;
 }
+
+/* ***************************************************************
+ * Startup stages that only need PECI, run while main() loads the
+ * Redfish inventory. Discovery is retried while the host may still
+ * be coming up and fails for good once the inventory is in and one
+ * more attempt has failed.
+ *****************************************************************/
+void *startupPeciThread(void *pArg)
+{
+	sigset_t mask;
+	int lastTry;
+
+	UN_USED(pArg);
+	sigfillset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+	prctl(PR_SET_NAME,__FUNCTION__,0,0,0);
+
+	beginStage(STAGE_PECI);
+	while (1) {
+		lastTry = isStageFinished(STAGE_INVENTORY);
+		if ( 0 == getCPUNrTypeAndBus(&nrCPU, type, bus) ) {
+			break;
+		}
+		if (lastTry) {
+			TCRIT("Error: Get CPU number, or CPU Type or Bus number\n ");
+			endStage(STAGE_PECI, 0);
+			endStage(STAGE_ADDR_DECODE, 0);
+			return NULL;
+		}
+		sleep(PECI_DISCOVERY_RETRY);
+	}
+	endStage(STAGE_PECI, 1);
+
+	/* Initialization of ADDRESS_TRANSLATION */
+	beginStage(STAGE_ADDR_DECODE);
+#if defined (CONFIG_SPX_FEATURE_MFP_2)
+	EFI_STATUS eresult = InitAddressDecodeLib(nrCPU);
+#elif defined (CONFIG_SPX_FEATURE_MFP_3)
+	EFI_STATUS eresult = InitAddressDecodeLib(bus, nrCPU);
 #endif
+	if( EFI_SUCCESS !=  eresult) {
+		TCRIT("InitAddressDecodeLib() fails: 0x%llx\n", eresult);
+	}
+	else if ( 0 == waitStages(STAGE_BIT(STAGE_INVENTORY)) ) {
+		buildDecodeTables();
+	}
+	endStage(STAGE_ADDR_DECODE, 1);
+	return NULL;
+}
 
 int main(int argc, char* argv[])
 {
@@ -2202,21 +5154,24 @@ int main(int argc, char* argv[])
 	int fdFifo = 0;
 	int fdValFifo = 0;
 	pthread_t mfpMemFault;
-	int readByte = 0;
-	struct mfp_error err;
-	mfpval_error	valerr;
+	static struct mfp_pipe_rx dataRx;
+	static struct mfp_pipe_rx valRx;
 	pthread_t mfpCompute;
+	pthread_condattr_t condAttr;
 
 	pthread_t mfp2ErrCollect;
-#if defined CONFIG_SPX_FEATURE_MFP_3_1 && defined (MRT_CPU_HBM)
-	/* MRT3.1 specific to HBM*/
-	pthread_t mfp2ErrCollectHbm;
-#endif
+	pthread_t mfpSelWriter;
+	pthread_t mfpStartupPeci;
 	size_t i;
-	struct timeval readTimeout;
-	int retVal = 0;
-	struct mfp_stat_result *mstat=NULL;
-
+	int fdEpoll = -1;
+	int fdValKey = -1;
+	struct epoll_event events[MAIN_EPOLL_EVENTS];
+	char valKeyDir[PATH_MAX];
+	char *valKeyName = NULL;
+	INT32 valMode = 0;
+	int nEvents = 0;
+
+	startupMs = getMonoMs();
 	if(daemon_init() != 0) {
        TCRIT("Error Daemonizing !!!\n");
     }
@@ -2252,6 +5207,54 @@ int main(int argc, char* argv[])
         goto END;
     }
 
+    /* the receive loop drains both FIFOs until EAGAIN on every wakeup */
+    if (-1 == fcntl(fdFifo, F_SETFL, fcntl(fdFifo, F_GETFL) | O_NONBLOCK) ||
+    		-1 == fcntl(fdValFifo, F_SETFL, fcntl(fdValFifo, F_GETFL) | O_NONBLOCK)) {
+        TCRIT("Error setting named pipes non-blocking\n");
+        goto END;
+    }
+    dataRx.fd = fdFifo;
+    dataRx.tag = MAIN_EV_FIFO;
+    dataRx.recSize = sizeof(struct mfp_error);
+    valRx.fd = fdValFifo;
+    valRx.tag = MAIN_EV_VALFIFO;
+    valRx.recSize = sizeof(mfpval_error);
+
+    /*
+     * main() serves both FIFOs from one epoll loop and learns about
+     * MFP_VAL_KEY appearing or disappearing through inotify on its
+     * directory. Records never wait in the pipe: a full batch queues
+     * them in the overflow tier.
+     */
+    fdEpoll = epoll_create1(EPOLL_CLOEXEC);
+    fdValKey = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (-1 == fdEpoll || -1 == fdValKey) {
+        TCRIT("Error creating event loop descriptors: %s\n", strerror(errno));
+        goto END;
+    }
+
+    strncpy(valKeyDir, MFP_VAL_KEY, sizeof(valKeyDir) - 1);
+    valKeyDir[sizeof(valKeyDir) - 1] = '\0';
+    valKeyName = strrchr(valKeyDir, '/');
+    if (valKeyName == NULL || valKeyName == valKeyDir) {
+        TCRIT("Unexpected %s path\n", MFP_VAL_KEY);
+        goto END;
+    }
+    *valKeyName++ = '\0';
+    if (-1 == inotify_add_watch(fdValKey, valKeyDir, IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM)) {
+        /* e.g. the directory does not exist yet: check MFP_VAL_KEY with access() */
+        TWARN("Unable to watch %s: %s, check %s every %d ms\n", valKeyDir, strerror(errno), MFP_VAL_KEY, VAL_KEY_POLL_MS);
+        close(fdValKey);
+        fdValKey = -1;
+    }
+
+    if (-1 == setMainEpoll(fdEpoll, EPOLL_CTL_ADD, fdFifo, EPOLLIN, MAIN_EV_FIFO) ||
+    		-1 == setMainEpoll(fdEpoll, EPOLL_CTL_ADD, fdValFifo, EPOLLIN, MAIN_EV_VALFIFO) ||
+    		(fdValKey >= 0 && -1 == setMainEpoll(fdEpoll, EPOLL_CTL_ADD, fdValKey, EPOLLIN, MAIN_EV_VALKEY))) {
+        TCRIT("Error adding event loop descriptors: %s\n", strerror(errno));
+        goto END;
+    }
+
 	
     if (-1 == mkfifo (MFPFAULTQUEUE, 0777) && (errno != EEXIST))
     {
@@ -2271,8 +5274,20 @@ int main(int argc, char* argv[])
     connect_signal(SIGUSR1, mfp_sigusr1_handler, NULL);
 #endif 
     
-	gettimeofday(&tlastErr, NULL);
-	gettimeofday(&tlastSave, NULL);
+	getMonoTime(&tlastErr);
+	getMonoTime(&tlastSave);
+	pthread_condattr_init(&condAttr);
+	pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+	pthread_cond_init(&mfpDataCond, &condAttr);
+	pthread_cond_init(&selQueueCond, &condAttr);
+	pthread_condattr_destroy(&condAttr);
+
+	if (0 != pthread_create(&mfpStartupPeci, NULL, startupPeciThread, NULL)) {
+		TCRIT("Unable create mfp PECI startup thread\n");
+		goto END;
+	}
+	pthread_detach(mfpStartupPeci);
+	beginStage(STAGE_INVENTORY);
 
 #if defined(EVB_DEBUG)
 	setDimm();
@@ -2283,17 +5298,20 @@ int main(int argc, char* argv[])
 	
 	if ( -1 == checkInventoryDataReady() ) {
 		TCRIT("MFP failed: checkInventoryDataReady()\n");
+		endStage(STAGE_INVENTORY, 0);
 		goto END;
 	}
 	TDBG("MFP: checkInventoryDataReady() is done\n");
 
 	if ( -1 == getRedfishEnv() ) {
 		TCRIT("MFP failed: getRedfishEnv()\n");
+		endStage(STAGE_INVENTORY, 0);
 		goto END;
 	}
 	
 	if ( -1 == getMemEntries() ) {
 		TCRIT("MFP failed: getMemEntries()\n");
+		endStage(STAGE_INVENTORY, 0);
 		goto END;
 	}	
 
@@ -2301,14 +5319,16 @@ int main(int argc, char* argv[])
 	
 	if ( -1 == getDimm(&dimmCount, dimmArray, dimmID) ) {
 		TCRIT("MFP failed: getDimm()\n");
+		endStage(STAGE_INVENTORY, 0);
 		goto END;
 	}
 	TDBG("DIMM count %u\n", dimmCount);
+	endStage(STAGE_INVENTORY, 1);
 
-	if ( -1 == getCPUNrTypeAndBus(&nrCPU, type, bus) ) {
-		TCRIT("Error: Get CPU number, or CPU Type or Bus number\n ");
+	if ( 0 != waitStages(STAGE_BIT(STAGE_PECI)) ) {
 		goto END;
 	}
+	beginStage(STAGE_MEM_CONFIG);
 #ifdef CONFIG_SPX_FEATURE_MFP_3
 	//Always use first available dimm to get ecc mode for simplicity	
 	eccMode = GetEccMode((INT8U) dimmArray[0].loc.socket,
@@ -2320,6 +5340,7 @@ int main(int argc, char* argv[])
 							(INT8U)((device_of_first_imc + dimmArray[0].loc.imc)<<3),  (INT8U)dimmArray[0].loc.channel);
 	if (DDR5ColWidth < 0 ) {
 		TCRIT("Get DDR5 Column Width Error");
+		endStage(STAGE_MEM_CONFIG, 0);
 		goto END;
 	}
 	TINFO("DDR5 Column Width: %d", DDR5ColWidth);
@@ -2329,32 +5350,11 @@ int main(int argc, char* argv[])
 
 #endif
 #endif
+	endStage(STAGE_MEM_CONFIG, 1);
 	
-    if (access( MFP_STAT_RESULT, F_OK ) != 0 ) {
-    	fpStat = fopen(MFP_STAT_RESULT,"w+b");		
-		if(fpStat == NULL) {
-			TCRIT("Unable to create %s file\n", MFP_STAT_RESULT);
-			goto END;
-		}
-		else {
-			mstat = (struct mfp_stat_result *)calloc(MAX_DIMM_COUNT, sizeof(struct mfp_stat_result));
-		    if( NULL == mstat)
-		    {
-		        TCRIT("Unable to Allocate Memory for MFP Stat Result\n");
-		        goto END;
-		    }
-			
-			TINFO("stat result mstat size is  %u \n", MAX_DIMM_COUNT*sizeof(struct mfp_stat_result));
-			if ( 1 != fwrite(mstat, MAX_DIMM_COUNT*sizeof(struct mfp_stat_result), 1, fpStat)) {
-				TCRIT("writing MFP Stat Result error\n");
-				free(mstat);
-				fclose(fpStat);
-				goto END;
-			}
-			free(mstat);
-			fclose(fpStat);
-		}
-    }
+	if ( 0 != mapStatResult() ) {
+		goto END;
+	}
 
 	results = malloc(dimmCount * sizeof(struct mfp_evaluate_result));
     if( NULL == results)
@@ -2380,6 +5380,11 @@ int main(int argc, char* argv[])
         TCRIT("Unable to Allocate Memory for cellOffLinedPagesSysAddr\n");
         goto END;
     }
+
+	if ( 0 != pageSetInit(&rowPageSet, MAX_TOTAL_ROW_FAULT_PAGE_NUM) || 0 != pageSetInit(&cellPageSet, MAX_TOTAL_CELL_FAULT_PAGE_NUM) ) {
+		TCRIT("Unable to Allocate Memory for offlined page sets\n");
+		goto END;
+	}
 	
 	pRowFaultRec = fopen(MRT_ROW_FAULT_REC,"a+b");
 	if(pRowFaultRec == NULL) {
@@ -2393,20 +5398,18 @@ int main(int argc, char* argv[])
 		goto END;
 	}	
     
-    /* This thread keeps fetching memory errors from CPU using PECI */
-	if (0 != pthread_create(&mfp2ErrCollect, NULL, mfp2Thread, NULL)) {
-		TCRIT("Unable create mfp Compute thread\n");
+	mfpValMode = ( access( MFP_VAL_KEY, F_OK ) == 0 );
+
+	if (0 != pthread_create(&mfpSelWriter, NULL, selWriterThread, NULL)) {
+		TCRIT("Unable create mfp SEL writer thread\n");
 		goto END;
 	}
 
-#if defined CONFIG_SPX_FEATURE_MFP_3_1 && defined (MRT_CPU_HBM)
-	/* MRT3.1 specific to HBM*/
-	/* This thread keeps fetching memory errors from CPU using PECI */
-	if (0 != pthread_create(&mfp2ErrCollectHbm, NULL, mfp2ThreadHbm, NULL)) {
-		TCRIT("Unable create HBM mfp Compute thread\n");
+    /* This thread keeps fetching DDR and HBM memory errors from CPU using PECI */
+	if (0 != pthread_create(&mfp2ErrCollect, NULL, mfp2Thread, NULL)) {
+		TCRIT("Unable create mfp Compute thread\n");
 		goto END;
 	}
-#endif
 
 	if (0 != pthread_create(&mfpCompute, NULL, computeMFPThread, NULL)) {
 		TCRIT("Unable create mfp Compute thread\n");
@@ -2424,114 +5427,72 @@ int main(int argc, char* argv[])
 		TCRIT("Process Monitor Register mfp fails\n");
 	}
 
-DATA_REC:
+	if (mfpValMode) {
+		TINFO("Go to MFP Validation Data Receiving loop\n");
+	}
+
+	/*
+	 * Records are accepted from both FIFOs in either mode. Those of the
+	 * inactive mode wait in their batch, as they used to wait in the pipe.
+	 */
 	while (1)
 	{
-		if ( access( MFP_VAL_KEY, F_OK ) == 0 ) {
-			TINFO("Go to MFP Validation Data Receiving loop\n");
-			break;
-		}
-		
-		if (newErrNum < MAX_NEWERR) {
-			readTimeout.tv_sec = PIPE_READ_TIMEOUT;
-			readTimeout.tv_usec = 0;
-			retVal = checkPipeDataAvail(fdFifo, &readTimeout);
-			if ( retVal> 0 ) {
-				readByte = sigwrap_read(fdFifo, (void *)&err, sizeof (struct mfp_error));
-				if (sizeof (struct mfp_error) == readByte) {
-					TDBG(" Get Data mfp: newErrNum = %d\n", newErrNum+1);
-					pthread_mutex_lock(&mfpDataMutex);
-					
-					memcpy(&newErr[newErrNum], &err, sizeof(err));
-					newErrNum++;
-#ifdef DEBUG
-					TDBG("MFP error count %d:", newErrNum);
-			        for(i=0; (int)i<newErrNum;++i){
-			        	TDBG("\t[%d] skt %d imc %d ch %d dimm %d rank %d device %d bg %d bank %d row 0x%x col 0x%x", i
-			        		, newErr[i].socket, newErr[i].imc,  newErr[i].channel
-							, newErr[i].dimm,   newErr[i].rank, newErr[i].device, newErr[i].bank_group
-							, newErr[i].bank,   newErr[i].row,  newErr[i].col);
-			        }
-#endif
-					gettimeofday(&tlastErr, NULL);
-					AddMFPSELEntries(&err);
-					
-					pthread_mutex_unlock(&mfpDataMutex);
-				}
-				else {
-					if (readByte == 0) {
-						TCRIT(" no data is read \n");
-					}
-					if(errno == EINTR || errno == EAGAIN)
-					{
-						TCRIT(" reading mfp pipe gets error %d, readByte= %d", errno, readByte);
-					}
-					TWARN("Not get right size of data\n");
-				}
-			}		
-			else if (retVal == 0) {
-//				TDBG(" read %s time out %u seconds\n", MFPQUEUE, readTimeout.tv_sec);
-			}
-			else {
-				TCRIT("%s \n", strerror(errno));
+		nEvents = epoll_wait(fdEpoll, events, MAIN_EPOLL_EVENTS, fdValKey >= 0 ? -1 : VAL_KEY_POLL_MS);
+		if (fdValKey < 0) {
+			valMode = ( access( MFP_VAL_KEY, F_OK ) == 0 );
+			if (valMode != mfpValMode) {
+				TINFO("Go to MFP %sData Receiving loop\n", valMode ? "Validation " : "");
+				setMfpValMode(valMode);
 			}
 		}
-		else {
-			TDBG("Wait for MFP Data finish processing\n");
-			sleep(1);
-		}
-	}
-	
-// MFP Validation loop
-	while (1)
-	{
-		if ( access( MFP_VAL_KEY, F_OK ) != 0 ) {
-			TINFO("Go to MFP Data Receiving loop\n");
-			goto DATA_REC;
+		if (nEvents < 0) {
+			if (errno != EINTR) {
+				TCRIT("epoll_wait fails: %s\n", strerror(errno));
+			}
+			continue;
 		}
-		
-		if (newValErrNum < MAX_NEWERR) {
-			readTimeout.tv_sec = PIPE_READ_TIMEOUT;
-			readTimeout.tv_usec = 0;
-			retVal = checkPipeDataAvail(fdValFifo, &readTimeout);
-			if ( retVal> 0 ) {
-				readByte = sigwrap_read(fdValFifo, (void *)&valerr, sizeof (valerr));
-				if (sizeof (mfpval_error) == readByte) {
-					TDBG(" Get Data mfp validation\n");
-					pthread_mutex_lock(&mfpDataMutex);
-					
-					memcpy(&newValErr[newValErrNum], &valerr, sizeof(valerr));
-					newValErrNum++;
-					gettimeofday(&tlastErr, NULL);
-
-					pthread_mutex_unlock(&mfpDataMutex);
+
+		for (i=0; (int)i<nEvents; i++) {
+			switch (events[i].data.u32) {
+			case MAIN_EV_FIFO:
+				if (readPipeRecords(&dataRx) > 0) {
+					deliverPipeErrors(&dataRx);
 				}
-				else {
-					if (readByte == 0) {
-						TCRIT(" no data is read \n");
-					}
-					if(errno == EINTR || errno == EAGAIN)
-					{
-						TCRIT(" reading mfpval pipe gets error %d, readByte= %d", errno, readByte);
+				break;
+
+			case MAIN_EV_VALFIFO:
+				if (readPipeRecords(&valRx) > 0) {
+					deliverPipeValErrors(&valRx);
+				}
+				break;
+
+			case MAIN_EV_VALKEY:
+				if (readValKeyEvents(fdValKey, valKeyName)) {
+					valMode = ( access( MFP_VAL_KEY, F_OK ) == 0 );
+					if (valMode != mfpValMode) {
+						TINFO("Go to MFP %sData Receiving loop\n", valMode ? "Validation " : "");
+						setMfpValMode(valMode);
 					}
-					TWARN("Not get right size of data\n");
 				}
-			}		
-			else if (retVal == 0) {
-				TDBG(" read %s time out %u seconds\n", MFPVALQUEUE, readTimeout.tv_sec);
-			}
-			else {
-				TCRIT("%s \n", strerror(errno));
+				break;
+
+			default:
+				TCRIT("unknown event tag %u\n", events[i].data.u32);
 			}
 		}
-		else {
-			TDBG("Wait for MFP Val Data finish processing\n");
-			sleep(1);
-		}
 	}
 
 END:
 	TCRIT("MFP Daemon fails to start\n");
+	if (fdEpoll >= 0) {
+		close(fdEpoll);
+	}
+
+	if (fdValKey >= 0) {
+		close(fdValKey);
+	}
+
+
 	if (fdFifo > 0) {
 		sigwrap_close(fdFifo);
 	}
@@ -2544,13 +5505,14 @@ END:
 		free(results);
 	}
 	
-	if (fpStat != NULL) {
-		fclose(fpStat);  	
-	}
+	unmapStatResult();
 	
 	if (fdFaultFifo > 0) {
 		sigwrap_close(fdFaultFifo);
 	}
+	if (fdFaultAck >= 0) {
+		sigwrap_close(fdFaultAck);
+	}
 	
 	if (pRowFaultRec) {
 		fclose(pRowFaultRec);
@@ -2567,6 +5529,8 @@ END:
 	if (cellOffLinedPagesSysAddr) {
 		free(cellOffLinedPagesSysAddr);
 	}
+	pageSetFree(&rowPageSet);
+	pageSetFree(&cellPageSet);
 	
 	return 0;
 }
@@ -2649,23 +5613,21 @@ int updateStatResult(struct mfp_dimm dimm, struct mfp_stat_result *result)
 		return -1;
 	}
 
-	fpStat = fopen(MFP_STAT_RESULT,"rb+");		
-	if(fpStat == NULL) {
-		TCRIT("Unable to open %s file\n", MFP_STAT_RESULT);
+	pthread_mutex_lock(&statMapMutex);
+	if (statMap == NULL || dimmInd >= MAX_DIMM_COUNT) {
+		pthread_mutex_unlock(&statMapMutex);
+		TCRIT("Update MFP Stat Result error\n");
 		return -1;
 	}
-	
-	if ( 0 != fseek(fpStat, dimmInd*sizeof(struct mfp_stat_result), SEEK_SET)) {
-		TCRIT("fseek returns error, not update MFP Stat Result\n");
+	if ( 0 != memcmp(&statMap[dimmInd], result, sizeof(struct mfp_stat_result)) ) {
+		memcpy(&statMap[dimmInd], result, sizeof(struct mfp_stat_result));
+		statMapDirty = 1;
+		statMapStat.updates++;
 	}
 	else {
-		if ( 1 != fwrite(result, sizeof(struct mfp_stat_result), 1, fpStat) ) {
-			TCRIT("Update MFP Stat Result error\n");
-			fclose(fpStat);
-			return -1;
-		}
+		statMapStat.unchanged++;
 	}
-	fclose(fpStat);
+	pthread_mutex_unlock(&statMapMutex);
 	return 0;
 }
 
@@ -2707,23 +5669,22 @@ int updateStatResultByMemErr(struct mfp_error *memErr)
 int printStatResult()
 {
 	INT32U i = 0;
-	struct mfp_stat_result tmpResult;
 	
-	fpStat = fopen(MFP_STAT_RESULT,"rb+");		
-	if(fpStat == NULL) {
-		TCRIT("Unable to open %s file\n", MFP_STAT_RESULT);
+	pthread_mutex_lock(&statMapMutex);
+	if (statMap == NULL) {
+		pthread_mutex_unlock(&statMapMutex);
+		TCRIT("%s is not mapped\n", MFP_STAT_RESULT);
 		return -1;
 	}
 	
-	while ( 1 == fread(&tmpResult, sizeof(struct mfp_stat_result), 1, fpStat) ) {
-		if (tmpResult.err_count != 0) {
+	for (i=0; i<MAX_DIMM_COUNT; i++) {
+		if (statMap[i].err_count != 0) {
 			printf("DIMM%u: Scoket-IMC-Channel-Slot: %u-%u-%u-%u\n", i, i/16, (i%16)/4, (i%4)/2, i%2);
-			mfp_stat_print(&tmpResult);
+			mfp_stat_print(&statMap[i]);
 		}
-		i++;
 	}
 	
-	fclose(fpStat);
+	pthread_mutex_unlock(&statMapMutex);
 	return 0;
 }
 
@@ -0,0 +1,503 @@
+/******************************************************************
+ ******************************************************************
+ ***                                                             **
+ ***    (C)Copyright 2020, American Megatrends Inc.             **
+ ***                                                             **
+ ***    All Rights Reserved.                                     **
+ ***                                                             **
+ ***    5555 , Oakbrook Pkwy, Norcross,                          **
+ ***                                                             **
+ ***    Georgia - 30093, USA. Phone-(770)-246-8600.              **
+ ***                                                             **
+ ******************************************************************
+ ******************************************************************
+ ******************************************************************
+ *
+ * mfp_bench.c
+ * measurements behind the mfp.c collection and delivery paths
+ *
+ * Built from the same package as mfp, with the same include path,
+ * CONFIG_SPX_FEATURE_MFP_* flags and libraries, into a separate
+ * mfp_bench binary that is not installed by default.
+ *
+ * Usage: mfp_bench <test> [count]
+ *	pageset		offlined page lookups, page set against the former linear scan
+ *	fifo		MFPQUEUE receive throughput, one read per record against the
+ *				framed drain of main()
+ *	sweep		CE sweep period over PECI: per DIMM against per channel, and one
+ *				thread against one thread per socket. Stop mfp first; the
+ *				errors LookForErrors() reads here are not reported.
+ *	sel			MFP SEL insert latency, one local IPMI session per insert
+ *				against one reused session. Adds 2 * count MFP records to
+ *				the SEL.
+ ******************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include "Types.h"
+#include "mfp.h"
+#include "mfp_ami.h"
+#include "mfp_pageset.h"
+#include "cpu.h"
+#include "libipmi_session.h"
+#include "libipmi_StorDevice.h"
+#include "IPMI_SEL.h"
+#include "SEL_OEMRcdType.h"
+#if defined (CONFIG_SPX_FEATURE_MFP_3)
+#include "libpeci4.h"
+#include "peci-ioctl.h"
+#include "peci.h"
+#endif
+
+/* a private FIFO with the MFPQUEUE record format, so a running mfp is not disturbed */
+#define BENCH_FIFO			"/tmp/mfp_bench_fifo"
+#define BENCH_RX_BUF_RECS	64	/* PIPE_RX_BUF_RECS of mfp.c */
+
+/* sweep layout: two sockets with two DIMMs on every channel, 32 DIMMs on ICX */
+#define BENCH_SOCKETS			2
+#define BENCH_DIMMS_PER_CHAN	2
+
+static INT8U	nrCPU;
+static CpuTypes	type[MAX_AMOUNT_OF_CPUS];
+static INT8U	bus[MAX_AMOUNT_OF_CPUS];
+
+struct sweep_worker {
+	INT8U	socket;
+	int		perDimm;
+	unsigned long	count;
+	unsigned long	errs;
+};
+
+struct mfp_bench {
+	const char	*name;
+	int			(*run)(unsigned long count);
+	unsigned long	defCount;
+};
+
+static unsigned long long elapsedUs(struct timespec *t0, struct timespec *t1)
+{
+	return (unsigned long long)(t1->tv_sec - t0->tv_sec) * 1000000ULL + (t1->tv_nsec - t0->tv_nsec) / 1000;
+}
+
+/* ***************************************************************
+ * Look up count pages, half of them offlined, in a page set and in
+ * the linear scan isNewPageAddress() did before, both holding the
+ * maximum row page count. The scan is sampled every 64th lookup.
+ *****************************************************************/
+static int benchPageSet(unsigned long count)
+{
+	struct mfp_page_set set;
+	unsigned long long *pages;
+	struct timespec t0, t1;
+	unsigned long i, j, hits = 0, scanHits = 0;
+	unsigned long long setUs, scanUs;
+
+	pages = malloc(MAX_TOTAL_ROW_FAULT_PAGE_NUM * sizeof(unsigned long long));
+	if (pages == NULL || pageSetInit(&set, MAX_TOTAL_ROW_FAULT_PAGE_NUM) != 0) {
+		free(pages);
+		return -1;
+	}
+	for (i=0; i<MAX_TOTAL_ROW_FAULT_PAGE_NUM; i++) {
+		pages[i] = ((unsigned long long)i * 0x3A5000ULL + 0x100000000ULL) & ADDR_TRANS_MASK_4K;
+		pageSetAdd(&set, pages[i]);
+	}
+
+	/* odd lookups hit the second half of a page far above every offlined one */
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i=0; i<count; i++) {
+		hits += pageSetHas(&set, pages[(i/2) % MAX_TOTAL_ROW_FAULT_PAGE_NUM] + (i & 1) * 0x800ULL + (i & 1) * (1ULL << 40));
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	setUs = elapsedUs(&t0, &t1);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i=0; i<count; i+=64) {
+		unsigned long long addr = pages[(i/2) % MAX_TOTAL_ROW_FAULT_PAGE_NUM] + (i & 1) * 0x800ULL + (i & 1) * (1ULL << 40);
+		for (j=0; j<MAX_TOTAL_ROW_FAULT_PAGE_NUM; j++) {
+			if (pages[j] == (addr & ADDR_TRANS_MASK_4K)) {
+				scanHits++;
+				break;
+			}
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	scanUs = elapsedUs(&t0, &t1) * 64;
+
+	printf("pageset: %u pages, %lu lookups (%lu hits)\n", MAX_TOTAL_ROW_FAULT_PAGE_NUM, count, hits);
+	printf("\tpage set     %llu us, %llu ns per lookup\n", setUs, setUs * 1000 / count);
+	printf("\tlinear scan ~%llu us, %llu ns per lookup (%lu hits sampled)\n", scanUs, scanUs * 1000 / count, scanHits);
+	pageSetFree(&set);
+	free(pages);
+	return 0;
+}
+
+/* the IPMI handler writes one record per request */
+static void *fifoWriter(void *pArg)
+{
+	unsigned long count = *(unsigned long *)pArg;
+	struct mfp_error err;
+	unsigned long i;
+	int fd;
+
+	fd = open(BENCH_FIFO, O_WRONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	memset(&err, 0, sizeof(err));
+	for (i=0; i<count; i++) {
+		err.row = i;
+		if (write(fd, &err, sizeof(err)) != sizeof(err)) {
+			break;
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+/* the former main() loop: select, then read a single record */
+static unsigned long fifoReadRecords(int fd, unsigned long count, unsigned long *wakeups)
+{
+	struct mfp_error err;
+	struct timeval tv;
+	fd_set rfds;
+	unsigned long got = 0, reads = 0;
+
+	while (got < count) {
+		FD_ZERO(&rfds);
+		FD_SET(fd, &rfds);
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		if (select(fd + 1, &rfds, NULL, NULL, &tv) <= 0) {
+			break;
+		}
+		(*wakeups)++;
+		reads++;
+		if (read(fd, &err, sizeof(err)) == sizeof(err)) {
+			got++;
+		}
+	}
+	return reads;
+}
+
+/* readPipeRecords() and consumePipeRecords() of main(): drain the pipe per wakeup */
+static unsigned long fifoDrainRecords(int fd, unsigned long count, unsigned long *wakeups)
+{
+	struct mfp_error buf[BENCH_RX_BUF_RECS];
+	struct epoll_event ev;
+	size_t len = 0, used;
+	unsigned long got = 0, reads = 0;
+	ssize_t readByte;
+	int fdEpoll;
+
+	fdEpoll = epoll_create1(0);
+	if (fdEpoll < 0) {
+		return 0;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	epoll_ctl(fdEpoll, EPOLL_CTL_ADD, fd, &ev);
+	while (got < count) {
+		if (epoll_wait(fdEpoll, &ev, 1, 1000) <= 0) {
+			break;
+		}
+		(*wakeups)++;
+		while (len < sizeof(buf)) {
+			reads++;
+			readByte = read(fd, (char *)buf + len, sizeof(buf) - len);
+			if (readByte <= 0) {
+				break;
+			}
+			len += readByte;
+		}
+		used = len / sizeof(struct mfp_error) * sizeof(struct mfp_error);
+		got += len / sizeof(struct mfp_error);
+		memmove(buf, (char *)buf + used, len - used);
+		len -= used;
+	}
+	close(fdEpoll);
+	return reads;
+}
+
+/* ***************************************************************
+ * Push count records through a FIFO as fast as the writer can and
+ * time how long the reader takes to receive them in either mode
+ *****************************************************************/
+static int benchFifo(unsigned long count)
+{
+	pthread_t writer;
+	struct timespec t0, t1;
+	unsigned long long us;
+	unsigned long reads, wakeups;
+	int framed, fd;
+
+	if (mkfifo(BENCH_FIFO, 0600) != 0 && errno != EEXIST) {
+		fprintf(stderr, "cannot create %s: %s\n", BENCH_FIFO, strerror(errno));
+		return -1;
+	}
+	printf("fifo: %lu records of %zu bytes\n", count, sizeof(struct mfp_error));
+	for (framed=0; framed<2; framed++) {
+		fd = open(BENCH_FIFO, O_RDWR | (framed ? O_NONBLOCK : 0));
+		if (fd < 0) {
+			unlink(BENCH_FIFO);
+			return -1;
+		}
+		wakeups = 0;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (pthread_create(&writer, NULL, fifoWriter, &count) != 0) {
+			close(fd);
+			unlink(BENCH_FIFO);
+			return -1;
+		}
+		reads = framed ? fifoDrainRecords(fd, count, &wakeups) : fifoReadRecords(fd, count, &wakeups);
+		pthread_join(writer, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		close(fd);
+		us = elapsedUs(&t0, &t1);
+		printf("\t%-13s %llu us, %llu records/s, %lu wakeups, %lu reads\n",
+				framed ? "framed drain" : "one read", us, us ? count * 1000000ULL / us : 0, wakeups, reads);
+	}
+	unlink(BENCH_FIFO);
+	return 0;
+}
+
+/* getCPUNrTypeAndBus() of mfp.c, without waking PECI */
+static int findCPUs(void)
+{
+	INT8U i;
+
+	for (nrCPU=0; nrCPU<MAX_AMOUNT_OF_CPUS; nrCPU++) {
+		if (0 != peci_Ping(MIN_CPU_ADDRESS + nrCPU)) {
+			break;
+		}
+	}
+	for (i=0; i<nrCPU; i++) {
+		if (0 != ValidatePECIBus(i) || 0 != DetectCpuType(i, &type[i]) || 0 != RetrievePECIBus(i, &bus[i])) {
+			fprintf(stderr, "CPU %d: Bus validation & CPU detection failed\n", i);
+			return -1;
+		}
+	}
+	return nrCPU ? 0 : -1;
+}
+
+/* one sweep of a socket; perDimm reads every channel once per DIMM as mfp2Thread() used to */
+static unsigned long sweepSocket(INT8U socket, int perDimm)
+{
+	MemErrorStruct memErr[NUMBER_OF_MMIO_REGISTERS_SETS];
+	bool validError[NUMBER_OF_MMIO_REGISTERS_SETS];
+	INT8U iIMC, iChan, iSet;
+	int dimm;
+	unsigned long errs = 0;
+
+	for (iIMC=0; iIMC<NUMBER_OF_IMCS; iIMC++) {
+		for (iChan=0; iChan<NUMBER_OF_CHANNELS; iChan++) {
+			for (dimm=0; dimm<(perDimm ? BENCH_DIMMS_PER_CHAN : 1); dimm++) {
+				memset(validError, 0, sizeof(validError));
+				LookForErrors(bus[socket], type[socket], socket, iIMC, iChan, memErr, validError);
+				for (iSet=0; iSet<NUMBER_OF_MMIO_REGISTERS_SETS; iSet++) {
+					errs += validError[iSet];
+				}
+			}
+		}
+	}
+	return errs;
+}
+
+static void *sweepSocketThread(void *pArg)
+{
+	struct sweep_worker *worker = (struct sweep_worker *)pArg;
+	unsigned long i;
+
+	for (i=0; i<worker->count; i++) {
+		worker->errs += sweepSocket(worker->socket, worker->perDimm);
+	}
+	return NULL;
+}
+
+/* ***************************************************************
+ * Time count sweeps of the bench layout in each collection mode and
+ * report the average sweep period
+ *****************************************************************/
+static int benchSweep(unsigned long count)
+{
+	static const struct {
+		const char	*name;
+		int			perDimm;
+		int			threaded;
+	} modes[] = {
+		{ "per DIMM, serial",		1, 0 },
+		{ "per channel, serial",	0, 0 },
+		{ "per channel, socket threads",	0, 1 },
+	};
+	struct sweep_worker worker[BENCH_SOCKETS];
+	pthread_t thread[BENCH_SOCKETS];
+	int started[BENCH_SOCKETS];
+	struct timespec t0, t1;
+	unsigned long long us;
+	unsigned long i, errs;
+	INT8U iCPU, iIMC, iChan, sockets;
+	size_t m;
+
+	if (findCPUs() != 0) {
+		fprintf(stderr, "sweep: no CPU answers PECI\n");
+		return -1;
+	}
+	sockets = nrCPU < BENCH_SOCKETS ? nrCPU : BENCH_SOCKETS;
+	for (iCPU=0; iCPU<sockets; iCPU++) {
+		for (iIMC=0; iIMC<NUMBER_OF_IMCS; iIMC++) {
+			for (iChan=0; iChan<NUMBER_OF_CHANNELS; iChan++) {
+				RecognizeTypeOfErrorsStoredInRetryLogRegisters(iCPU, bus[iCPU], iIMC, iChan);
+			}
+		}
+	}
+	printf("sweep: %u sockets, %u DIMMs, %lu sweeps per mode\n",
+			sockets, sockets * NUMBER_OF_IMCS * NUMBER_OF_CHANNELS * BENCH_DIMMS_PER_CHAN, count);
+
+	for (m=0; m<sizeof(modes)/sizeof(modes[0]); m++) {
+		errs = 0;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (modes[m].threaded) {
+			for (iCPU=0; iCPU<sockets; iCPU++) {
+				worker[iCPU].socket = iCPU;
+				worker[iCPU].perDimm = modes[m].perDimm;
+				worker[iCPU].count = count;
+				worker[iCPU].errs = 0;
+				started[iCPU] = (pthread_create(&thread[iCPU], NULL, sweepSocketThread, &worker[iCPU]) == 0);
+				if (!started[iCPU]) {
+					sweepSocketThread(&worker[iCPU]);
+				}
+			}
+			for (iCPU=0; iCPU<sockets; iCPU++) {
+				if (started[iCPU]) {
+					pthread_join(thread[iCPU], NULL);
+				}
+				errs += worker[iCPU].errs;
+			}
+		}
+		else {
+			for (i=0; i<count; i++) {
+				for (iCPU=0; iCPU<sockets; iCPU++) {
+					errs += sweepSocket(iCPU, modes[m].perDimm);
+				}
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		us = elapsedUs(&t0, &t1);
+		printf("\t%-28s %llu us per sweep, %lu errors read\n", modes[m].name, us / count, errs);
+	}
+	return 0;
+}
+
+/* add one record, opening and closing a session around it unless pSession is given */
+static int selInsert(IPMI20_SESSION_T *pSession, SELOEM1Record_T *pRec, unsigned long long *openUs)
+{
+	IPMI20_SESSION_T session;
+	uint8_t byPrivLevel = PRIV_LEVEL_ADMIN;
+	AddSELRes_T AddSELRes;
+	struct timespec t0, t1;
+	int wRet;
+
+	if (pSession == NULL) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		wRet = LIBIPMI_Create_IPMI_Local_Session(&session,"","",&byPrivLevel,NULL,AUTH_BYPASS_FLAG,3);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		*openUs += elapsedUs(&t0, &t1);
+		if (wRet != LIBIPMI_E_SUCCESS) {
+			return -1;
+		}
+		pSession = &session;
+	}
+	pRec->TimeStamp = time(NULL);
+	wRet = IPMICMD_AddSELEntry(pSession, (SELEventRecord_T *)pRec, &AddSELRes, 3);
+	if (pSession == &session) {
+		LIBIPMI_CloseSession(&session);
+	}
+	return (wRet == LIBIPMI_E_SUCCESS && AddSELRes.CompletionCode == CC_SUCCESS) ? 0 : -1;
+}
+
+/* ***************************************************************
+ * Add count MFP SEL records the way AddMFPSELEntries() used to, with
+ * a session per record, then count more through one kept session
+ *****************************************************************/
+static int benchSel(unsigned long count)
+{
+	IPMI20_SESSION_T session;
+	uint8_t byPrivLevel = PRIV_LEVEL_ADMIN;
+	SELOEM1Record_T rec;
+	struct timespec t0, t1;
+	unsigned long long us, maxUs, totalUs, openUs;
+	unsigned long i, failed;
+	int reuse;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.Type = MEMORYFAILURE_OEMRECTYPE;
+	printf("sel: %lu inserts per mode\n", count);
+	for (reuse=0; reuse<2; reuse++) {
+		maxUs = totalUs = openUs = 0;
+		failed = 0;
+		if (reuse) {
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			if (LIBIPMI_Create_IPMI_Local_Session(&session,"","",&byPrivLevel,NULL,AUTH_BYPASS_FLAG,3) != LIBIPMI_E_SUCCESS) {
+				fprintf(stderr, "sel: cannot establish IPMI local session\n");
+				return -1;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			openUs = elapsedUs(&t0, &t1);
+		}
+		for (i=0; i<count; i++) {
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			failed += (selInsert(reuse ? &session : NULL, &rec, &openUs) != 0);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			us = elapsedUs(&t0, &t1);
+			totalUs += us;
+			if (us > maxUs) {
+				maxUs = us;
+			}
+		}
+		if (reuse) {
+			LIBIPMI_CloseSession(&session);
+		}
+		printf("\t%-16s avg %llu us, max %llu us per insert; session setup %llu us in total; %lu failed\n",
+				reuse ? "reused session" : "session each", totalUs / count, maxUs, openUs, failed);
+	}
+	return 0;
+}
+
+static const struct mfp_bench benches[] = {
+	{ "pageset",	benchPageSet,	MAX_TOTAL_ROW_FAULT_PAGE_NUM * 2 },
+	{ "fifo",		benchFifo,		100000 },
+	{ "sweep",		benchSweep,		100 },
+	{ "sel",		benchSel,		16 },
+};
+
+int main(int argc, char *argv[])
+{
+	unsigned long count;
+	size_t i;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <test> [count]\n", argv[0]);
+		for (i=0; i<sizeof(benches)/sizeof(benches[0]); i++) {
+			fprintf(stderr, "\t%s (default count %lu)\n", benches[i].name, benches[i].defCount);
+		}
+		return 1;
+	}
+	for (i=0; i<sizeof(benches)/sizeof(benches[0]); i++) {
+		if (strcmp(argv[1], benches[i].name) == 0) {
+			count = (argc > 2) ? strtoul(argv[2], NULL, 0) : benches[i].defCount;
+			if (count == 0) {
+				count = benches[i].defCount;
+			}
+			return benches[i].run(count) == 0 ? 0 : 1;
+		}
+	}
+	fprintf(stderr, "%s: unknown test %s\n", argv[0], argv[1]);
+	return 1;
+}
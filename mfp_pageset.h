@@ -0,0 +1,126 @@
+/******************************************************************
+ *
+ * mfp_pageset.h
+ * set of 4KB page addresses, shared by mfp.c and mfp_bench.c
+ *
+ ******************************************************************/
+#ifndef MFP_PAGESET_H
+#define MFP_PAGESET_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "Types.h"
+
+#define ADDR_TRANS_MASK_4K       ((unsigned long long) (~0x0FFF))
+
+/*
+ * Open addressing with linear probing on a power of two table at most
+ * half full; page 0 is tracked by hasZero since a zero slot marks an
+ * empty one.
+ */
+struct mfp_page_set {
+	unsigned long long	*slot;
+	INT32U	mask;
+	INT32U	shift;
+	INT32U	count;
+	int		hasZero;
+};
+
+static inline int pageSetInit(struct mfp_page_set *set, INT32U maxPages)
+{
+	INT32U size = 16, bits = 4;
+
+	while (size < maxPages * 2) {
+		size <<= 1;
+		bits++;
+	}
+	memset(set, 0, sizeof(*set));
+	set->slot = calloc(size, sizeof(unsigned long long));
+	if (set->slot == NULL) {
+		return -1;
+	}
+	set->mask = size - 1;
+	set->shift = 64 - bits;
+	return 0;
+}
+
+static inline void pageSetFree(struct mfp_page_set *set)
+{
+	free(set->slot);
+	memset(set, 0, sizeof(*set));
+}
+
+static inline INT32U pageSetHash(const struct mfp_page_set *set, unsigned long long page)
+{
+	return (INT32U)(((page >> 12) * 0x9E3779B97F4A7C15ULL) >> set->shift);
+}
+
+/* slot of page, or of the empty slot ending its probe sequence */
+static inline INT32U pageSetFind(const struct mfp_page_set *set, unsigned long long page)
+{
+	INT32U i = pageSetHash(set, page);
+
+	while (set->slot[i] != 0 && set->slot[i] != page) {
+		i = (i + 1) & set->mask;
+	}
+	return i;
+}
+
+static inline int pageSetHas(const struct mfp_page_set *set, unsigned long long sysAddr)
+{
+	unsigned long long page = sysAddr & ADDR_TRANS_MASK_4K;
+
+	if (page == 0) {
+		return set->hasZero;
+	}
+	return set->slot[pageSetFind(set, page)] != 0;
+}
+
+static inline void pageSetAdd(struct mfp_page_set *set, unsigned long long sysAddr)
+{
+	unsigned long long page = sysAddr & ADDR_TRANS_MASK_4K;
+	INT32U i;
+
+	if (page == 0) {
+		set->hasZero = 1;
+		return;
+	}
+	i = pageSetFind(set, page);
+	if (set->slot[i] == 0 && set->count <= set->mask / 2) {
+		set->slot[i] = page;
+		set->count++;
+	}
+}
+
+/* backward shift deletion keeps every probe sequence free of holes */
+static inline void pageSetRemove(struct mfp_page_set *set, unsigned long long sysAddr)
+{
+	unsigned long long page = sysAddr & ADDR_TRANS_MASK_4K;
+	INT32U i, j, home;
+
+	if (page == 0) {
+		set->hasZero = 0;
+		return;
+	}
+	i = pageSetFind(set, page);
+	if (set->slot[i] == 0) {
+		return;
+	}
+	j = i;
+	while (1) {
+		j = (j + 1) & set->mask;
+		if (set->slot[j] == 0) {
+			break;
+		}
+		home = pageSetHash(set, set->slot[j]);
+		/* move slot[j] back unless its home lies cyclically in (i, j] */
+		if (((j - home) & set->mask) >= ((j - i) & set->mask)) {
+			set->slot[i] = set->slot[j];
+			i = j;
+		}
+	}
+	set->slot[i] = 0;
+	set->count--;
+}
+
+#endif /* MFP_PAGESET_H */